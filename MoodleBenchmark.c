@@ -0,0 +1,548 @@
+// End-to-end benchmark: generates a synthetic command stream and runs it through the engine
+// Build: cc -O2 -pthread MoodleBenchmark.c -o MoodleBenchmark -lm
+// Usage: ./MoodleBenchmark [--commands N] [--students N] [--exams N] [--grades-per-student N]
+//        [--zipf S] [--mix NAME=WEIGHT,...] [--threads N] [--shards N] [--seed N]
+//        [--save FILE] [--compare FILE] [--alpha P] [--threshold PERCENT]
+// --save writes the latency histogram of every command type as a JSON baseline, --compare tests
+// every command type against one at the same student count and exits with 2 if any got slower
+// Tables are sized at build time, e.g. -DMAX_STUDENTS=10000000 -DMAX_GRADES=100000000
+#ifndef MAX_STUDENTS
+#define MAX_STUDENTS (1 << 20)  // Room for large populations, untouched pages cost no memory
+#endif
+#ifndef MAX_EXAMS
+#define MAX_EXAMS 4096
+#endif
+#ifndef MAX_GRADES
+#define MAX_GRADES (1 << 24)
+#endif
+#define MOODLE_NO_MAIN  // Reuse the engine without its batch main()
+#include "MoodleReplacement.c"
+
+#include <time.h>
+
+#define GENERATE_CHUNK 65536  // Commands generated before they are run and timed
+#define DEFAULT_MIX "SEARCH_GRADE=35,SEARCH_STUDENT=25,UPDATE_GRADE=15,ADD_GRADE=10,STUDENT_AVERAGE=5," \
+                    "EXAM_STATS=4,RANK=3,ADD_STUDENT=2,UPDATE_EXAM=1"
+#define MAX_COMMAND_NAME 32  // Longest command name in a baseline, including the terminator
+
+// Structure to store the parameters of a workload
+typedef struct {
+    long long commands;  // Commands run after populating the tables
+    int students;  // Students added before the run, the IDs commands pick from
+    int exams;  // Exams added before the run
+    int grades_per_student;  // Grades added per student before the run
+    double zipf;  // Skew of the ID distribution, 0 is uniform
+    double mix[COMMAND_UNKNOWN];  // Relative weight of every command type
+    int threads;  // More than one runs the parallel batch executor
+    int shards;
+    unsigned long long seed;
+} Workload;
+
+// Structure to store a Zipf distribution over the ranks 0..count-1
+typedef struct {
+    int count;
+    double *cdf;  // Probability of a rank at or below each rank
+} Zipf;
+
+static double mix_cdf[COMMAND_UNKNOWN];  // Cumulative share of the command types
+static unsigned long long random_state;  // Generator state
+static Zipf student_ids, exam_ids;  // Distributions the commands pick IDs from
+static int next_student_id, next_exam_id;  // IDs of the next ADD_STUDENT and ADD_EXAM
+static LatencySummary latencies[COMMAND_UNKNOWN];  // Histograms of the timed run per command type
+static LatencySummary baseline[COMMAND_UNKNOWN];  // Histograms read by --compare, count 0 where missing
+static double baseline_ticks_per_ns;  // Clock rate of the run that wrote the baseline
+static double alpha = 0.01;  // Significance level of the regression test
+static double threshold = 5;  // Least slowdown of the median in percent that counts, histogram buckets are 3% wide
+
+// Function to get a monotonic time in nanoseconds
+static long long now_nanoseconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+// Function to generate the next pseudo-random number
+static unsigned long long next_random(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 2685821657736338717ULL;
+}
+
+// Function to generate a pseudo-random number in [0, 1)
+static double next_uniform(void) {
+    return (next_random() >> 11) * 0x1.0p-53;
+}
+
+// Function to build a Zipf distribution, returns -1 when memory runs out
+static int zipf_init(Zipf *zipf, int count, double skew) {
+    zipf->count = count;
+    zipf->cdf = malloc((size_t)count * sizeof(double));
+    if (!zipf->cdf) {
+        return -1;
+    }
+    double sum = 0;
+    for (int rank = 0; rank < count; rank++) {
+        sum += pow(rank + 1, -skew);
+        zipf->cdf[rank] = sum;
+    }
+    for (int rank = 0; rank < count; rank++) {
+        zipf->cdf[rank] /= sum;
+    }
+    return 0;
+}
+
+// Function to draw an ID from a Zipf distribution, the most frequent ID is 1
+static int zipf_next(const Zipf *zipf) {
+    double u = next_uniform();
+    int low = 0, high = zipf->count - 1;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (zipf->cdf[middle] < u) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low + 1;
+}
+
+// Function to parse a command mix such as "SEARCH_GRADE=3,ADD_GRADE=1", returns -1 if it is invalid
+static int parse_mix(const char *text, double *mix) {
+    char copy[1024];
+    if (strlen(text) >= sizeof(copy)) {
+        return -1;
+    }
+    strcpy(copy, text);
+    memset(mix, 0, COMMAND_UNKNOWN * sizeof(double));
+    for (char *save, *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *equals = strchr(item, '=');
+        if (!equals) {
+            return -1;
+        }
+        *equals = '\0';
+        int type = 0;
+        while (type < COMMAND_UNKNOWN && strcmp(item, command_names[type]) != 0) {
+            type++;
+        }
+        double weight = strtod(equals + 1, NULL);
+        if (weight < 0) {
+            return -1;
+        }
+        switch (type) {
+        case COMMAND_ADD_STUDENT:
+        case COMMAND_ADD_EXAM:
+        case COMMAND_ADD_GRADE:
+        case COMMAND_UPDATE_EXAM:
+        case COMMAND_UPDATE_GRADE:
+        case COMMAND_DELETE_STUDENT:
+        case COMMAND_SEARCH_STUDENT:
+        case COMMAND_SEARCH_GRADE:
+        case COMMAND_EXAM_STATS:
+        case COMMAND_RANK:
+        case COMMAND_PERCENTILE:
+        case COMMAND_TOP_K:
+        case COMMAND_STUDENT_AVERAGE:
+        case COMMAND_TRANSCRIPT:
+        case COMMAND_ROSTER:
+            mix[type] = weight;
+            break;
+        default:
+            return -1;  // Commands over whole tables would dominate any mix
+        }
+    }
+    double total = 0;
+    for (int type = 0; type < COMMAND_UNKNOWN; type++) {
+        total += mix[type];
+    }
+    return total > 0 ? 0 : -1;
+}
+
+// Function to write the next command of the workload into line, returns its type
+static CommandType generate_command(char *line) {
+    double u = next_uniform();
+    int type = 0;
+    while (mix_cdf[type] <= u) {
+        type++;
+    }
+    int student_id = zipf_next(&student_ids);
+    int exam_id = zipf_next(&exam_ids);
+    int grade_value = (int)(next_random() % (MAX_GRADE + 1));
+    switch (type) {
+    case COMMAND_ADD_STUDENT:
+        sprintf(line, "ADD_STUDENT %d Benchmark %s\n", next_student_id, faculty_names[next_student_id % FACULTY_COUNT]);
+        next_student_id++;
+        break;
+    case COMMAND_ADD_EXAM:
+        sprintf(line, "ADD_EXAM %d WRITTEN Benchmark\n", next_exam_id++);
+        break;
+    case COMMAND_ADD_GRADE:
+    case COMMAND_UPDATE_GRADE:
+        sprintf(line, "%s %d %d %d\n", command_names[type], exam_id, student_id, grade_value);
+        break;
+    case COMMAND_UPDATE_EXAM:
+        sprintf(line, "UPDATE_EXAM %d DIGITAL Updated\n", exam_id);
+        break;
+    case COMMAND_SEARCH_GRADE:
+    case COMMAND_RANK:
+    case COMMAND_PERCENTILE:
+        sprintf(line, "%s %d %d\n", command_names[type], exam_id, student_id);
+        break;
+    case COMMAND_EXAM_STATS:
+    case COMMAND_ROSTER:
+        sprintf(line, "%s %d\n", command_names[type], exam_id);
+        break;
+    case COMMAND_TOP_K:
+        sprintf(line, "TOP_K %d 10\n", exam_id);
+        break;
+    default:
+        sprintf(line, "%s %d\n", command_names[type], student_id);  // Commands about one student
+        break;
+    }
+    return (CommandType)type;
+}
+
+// Function to add the students, exams and grades the workload picks from
+static void populate(const Workload *workload) {
+    char line[MAX_COMMAND_LENGTH];
+    for (int id = 1; id <= workload->students; id++) {
+        sprintf(line, "ADD_STUDENT %d Benchmark %s\n", id, faculty_names[id % FACULTY_COUNT]);
+        process_command(line);
+    }
+    for (int id = 1; id <= workload->exams; id++) {
+        sprintf(line, "ADD_EXAM %d WRITTEN Benchmark\n", id);
+        process_command(line);
+    }
+    for (int id = 1; id <= workload->students; id++) {
+        for (int i = 0; i < workload->grades_per_student; i++) {
+            sprintf(line, "ADD_GRADE %d %d %d\n", zipf_next(&exam_ids), id, (int)(next_random() % (MAX_GRADE + 1)));
+            process_command(line);
+        }
+    }
+}
+
+// Function to run the workload one command at a time, returns the run time
+static double run_serial(const Workload *workload) {
+    char (*lines)[MAX_COMMAND_LENGTH] = malloc(GENERATE_CHUNK * sizeof(*lines));
+    if (!lines) {
+        fprintf(stderr, "Failed to allocate the command stream\n");
+        exit(1);
+    }
+    long long elapsed = 0;
+    for (long long done = 0; done < workload->commands; done += GENERATE_CHUNK) {
+        int chunk = workload->commands - done < GENERATE_CHUNK ? (int)(workload->commands - done) : GENERATE_CHUNK;
+        for (int i = 0; i < chunk; i++) {
+            generate_command(lines[i]);
+        }
+        long long start = now_nanoseconds();
+        for (int i = 0; i < chunk; i++) {
+            process_command(lines[i]);  // Timed by the engine's per-command histograms
+        }
+        elapsed += now_nanoseconds() - start;
+    }
+    free(lines);
+    return elapsed / 1e9;
+}
+
+// Function to run the workload on the parallel batch executor, returns the run time
+static double run_parallel(const Workload *workload) {
+    FILE *stream = tmpfile();  // The executor reads its commands from a file, as from input.txt
+    if (!stream) {
+        perror("Failed to create the command stream");
+        exit(1);
+    }
+    char line[MAX_COMMAND_LENGTH];
+    for (long long i = 0; i < workload->commands; i++) {
+        generate_command(line);
+        fputs(line, stream);
+    }
+    rewind(stream);
+    long long start = now_nanoseconds();
+    if (run_batch_parallel(stream, workload->threads) != 0) {
+        exit(1);
+    }
+    long long end = now_nanoseconds();
+    fclose(stream);
+    return (end - start) / 1e9;
+}
+
+// Function to get the latency bucket holding a share of the commands of a histogram
+static int bucket_percentile(const LatencySummary *summary, double share) {
+    long long rank = (long long)ceil(share * summary->count);
+    long long seen = 0;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (seen += summary->buckets[bucket]) < rank) {
+        bucket++;
+    }
+    return bucket;
+}
+
+// Function to run the Mann-Whitney U test on the latencies of a command in a baseline and in this
+// run. Every command is a sample, ranked by its histogram bucket, so the commands of a bucket tie
+// and share their average rank. Sets the one-sided p-values of this run being slower and of it
+// being faster, from the normal approximation with the tie and continuity corrections.
+static void mann_whitney(const LatencySummary *before, const LatencySummary *after, double *p_slower,
+                         double *p_faster) {
+    double total = (double)before->count + after->count;
+    double rank_sum = 0;  // Sum of the ranks of this run's commands
+    double ties = 0;  // Sum of t^3 - t over the buckets of t tied commands
+    double seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        double tied = (double)before->buckets[bucket] + after->buckets[bucket];
+        rank_sum += after->buckets[bucket] * (seen + (tied + 1) / 2);
+        ties += tied * tied * tied - tied;
+        seen += tied;
+    }
+    double n1 = after->count, n2 = before->count;
+    double u = rank_sum - n1 * (n1 + 1) / 2;  // Pairs in which this run's command is slower
+    double mean = n1 * n2 / 2;
+    double deviation = sqrt(n1 * n2 / 12 * ((total + 1) - ties / (total * (total - 1))));
+    if (deviation == 0) {
+        *p_slower = *p_faster = 1;  // Every command fell in one bucket
+        return;
+    }
+    *p_slower = 0.5 * erfc((u - mean - 0.5) / deviation / sqrt(2));
+    *p_faster = 0.5 * erfc((mean - u - 0.5) / deviation / sqrt(2));
+}
+
+// Function to write the histograms of this run as a JSON baseline, one command type per line
+// with its non-empty buckets as [bucket, commands] pairs
+static int save_results(const char *path, const Workload *workload, double ticks_per_ns) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("Failed to open baseline file");
+        return -1;
+    }
+    fprintf(file, "{\n\"commands\": %lld,\n\"students\": %d,\n\"ticks_per_ns\": %.9g,\n\"results\": [\n",
+            workload->commands, workload->students, ticks_per_ns);
+    int first = 1;
+    for (int type = 0; type < COMMAND_UNKNOWN; type++) {
+        if (latencies[type].count == 0) {
+            continue;
+        }
+        fprintf(file, "%s{\"benchmark\": \"%s\", \"size\": %d, \"buckets\": [", first ? "" : ",\n",
+                command_names[type], workload->students);
+        int separator = 0;
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            if (latencies[type].buckets[bucket]) {
+                fprintf(file, "%s[%d, %lld]", separator++ ? ", " : "", bucket, latencies[type].buckets[bucket]);
+            }
+        }
+        fprintf(file, "]}");
+        first = 0;
+    }
+    fprintf(file, "\n]\n}\n");
+    if (fclose(file) != 0) {
+        perror("Failed to write baseline file");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to read the histograms of a baseline written by save_results at a student count,
+// returns -1 if it cannot be read. Command types measured at other student counts are left out
+static int load_baseline(const char *path, int students) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("Failed to open baseline file");
+        return -1;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    int malformed = 0;
+    while (!malformed && getline(&line, &capacity, file) > 0) {
+        const char *clock = strstr(line, "\"ticks_per_ns\":");
+        if (clock) {
+            baseline_ticks_per_ns = strtod(clock + strlen("\"ticks_per_ns\":"), NULL);
+            continue;
+        }
+        const char *object = strstr(line, "{\"benchmark\"");
+        if (!object) {
+            continue;  // Header and footer lines
+        }
+        char name[MAX_COMMAND_NAME];
+        int size;
+        const char *values = strstr(object, "\"buckets\": [");
+        if (!values || sscanf(object, "{\"benchmark\": \"%31[^\"]\", \"size\": %d", name, &size) != 2) {
+            malformed = 1;
+            break;
+        }
+        int type = 0;
+        while (type < COMMAND_UNKNOWN && strcmp(name, command_names[type]) != 0) {
+            type++;
+        }
+        if (type == COMMAND_UNKNOWN || size != students) {
+            continue;  // Another engine's command, or another table-size tier
+        }
+        LatencySummary *summary = &baseline[type];
+        memset(summary, 0, sizeof(LatencySummary));
+        int bucket, offset;
+        long long commands;
+        const char *cursor = values + strlen("\"buckets\": [");
+        for (; sscanf(cursor, " [%d, %lld]%n", &bucket, &commands, &offset) == 2; cursor += offset) {
+            cursor += cursor[offset] == ',';  // Skip the separator with the pair
+            if (bucket < 0 || bucket >= LATENCY_BUCKETS || commands < 0) {
+                malformed = 1;
+                break;
+            }
+            summary->buckets[bucket] += commands;
+            summary->count += commands;
+        }
+    }
+    free(line);
+    fclose(file);
+    if (malformed || baseline_ticks_per_ns <= 0) {
+        fprintf(stderr, "Malformed baseline file %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Workload workload = {1000000, 10000, 100, 4, 0.99, {0}, 1, 1, 88172645463325252ULL};
+    const char *mix = DEFAULT_MIX;
+    const char *save_path = NULL;  // Write the histograms as a JSON baseline here
+    const char *compare_path = NULL;  // Compare the histograms with this JSON baseline
+    int usage_error = 0;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage_error = 1;
+        } else if (strcmp(argv[i], "--commands") == 0) {
+            workload.commands = (long long)strtod(argv[++i], NULL);  // Accepts 1e8
+        } else if (strcmp(argv[i], "--students") == 0) {
+            workload.students = (int)strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--exams") == 0) {
+            workload.exams = (int)strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--grades-per-student") == 0) {
+            workload.grades_per_student = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--zipf") == 0) {
+            workload.zipf = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--mix") == 0) {
+            mix = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            workload.threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shards") == 0) {
+            workload.shards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            workload.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--save") == 0) {
+            save_path = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0) {
+            compare_path = argv[++i];
+        } else if (strcmp(argv[i], "--alpha") == 0) {
+            alpha = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--threshold") == 0) {
+            threshold = strtod(argv[++i], NULL);
+        } else {
+            usage_error = 1;
+        }
+    }
+    if (usage_error || workload.commands < 0 || workload.students < 1 || workload.students > MAX_STUDENTS ||
+        workload.exams < 1 || workload.exams > MAX_EXAMS || workload.grades_per_student < 0 ||
+        (long long)workload.students * workload.grades_per_student > MAX_GRADES || workload.zipf < 0 ||
+        workload.threads < 1 || workload.threads > MAX_SERVER_THREADS || workload.shards < 1 ||
+        workload.shards > MAX_SHARDS || parse_mix(mix, workload.mix) < 0 || alpha <= 0 || alpha >= 1 ||
+        threshold < 0) {
+        fprintf(stderr,
+                "Usage: %s [--commands N] [--students 1..%d] [--exams 1..%d] [--grades-per-student N]\n"
+                "       [--zipf S] [--mix NAME=WEIGHT,...] [--threads N] [--shards N] [--seed N]\n"
+                "       [--save FILE] [--compare FILE] [--alpha 0..1] [--threshold PERCENT]\n",
+                argv[0], MAX_STUDENTS, MAX_EXAMS);
+        return 1;
+    }
+    if (compare_path && load_baseline(compare_path, workload.students) < 0) {
+        return 1;
+    }
+    double total = 0;
+    for (int type = 0; type < COMMAND_UNKNOWN; type++) {
+        total += workload.mix[type];
+    }
+    int last_type = 0;
+    for (int type = 0; type < COMMAND_UNKNOWN; type++) {
+        mix_cdf[type] = (type > 0 ? mix_cdf[type - 1] : 0) + workload.mix[type] / total;
+        last_type = workload.mix[type] > 0 ? type : last_type;
+    }
+    mix_cdf[last_type] = 1;  // Rounding must not let a draw pass the last command of the mix
+    random_state = workload.seed ? workload.seed : 1;  // Xorshift never leaves zero
+    command_threads = workload.threads;
+    if (init_shards(workload.shards) < 0 || zipf_init(&student_ids, workload.students, workload.zipf) < 0 ||
+        zipf_init(&exam_ids, workload.exams, workload.zipf) < 0) {
+        fprintf(stderr, "Failed to allocate the tables\n");
+        return 1;
+    }
+    next_student_id = workload.students + 1;
+    next_exam_id = workload.exams + 1;
+    output = fopen("/dev/null", "w");  // Responses are formatted but thrown away
+
+    printf("Workload: %lld commands, %d students, %d exams, Zipf %.2f, %d threads, %d shards\n",
+           workload.commands, workload.students, workload.exams, workload.zipf, workload.threads, workload.shards);
+    long long start = now_nanoseconds();
+    populate(&workload);
+    latency_reset();  // Report the timed run only
+    printf("Populated %d students, %d exams and %d grades in %.2f s\n", (int)student_count, exam_count,
+           (int)grade_count, (now_nanoseconds() - start) / 1e9);
+
+    double elapsed = workload.threads > 1 ? run_parallel(&workload) : run_serial(&workload);
+    printf("Ran %lld commands in %.3f s, %.0f commands/s\n", workload.commands, elapsed,
+           elapsed > 0 ? workload.commands / elapsed : 0);
+    double ticks_per_ns = ticks_per_nanosecond();
+    if (compare_path) {
+        printf("Compared with %s: one-sided Mann-Whitney U test at alpha %g, median slowdown over %g%%\n",
+               compare_path, alpha, threshold);
+        if (fabs(ticks_per_ns / baseline_ticks_per_ns - 1) > 0.01) {
+            printf("Warning: the baseline clock ran at %.3f ticks/ns and this one at %.3f, buckets differ\n",
+                   baseline_ticks_per_ns, ticks_per_ns);
+        }
+    }
+    printf("%-16s %12s %10s %10s %10s %10s %10s %10s %10s", "command", "count", "errors", "mean ns", "p50 ns",
+           "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+    if (compare_path) {
+        printf(" %12s %9s %9s %s", "base p50 ns", "change", "p", "verdict");
+    }
+    printf("\n");
+    int regressions = 0;
+    for (int type = 0; type < COMMAND_UNKNOWN; type++) {
+        LatencySummary *summary = &latencies[type];
+        latency_merge(type, summary);  // Every thread of the parallel executor recorded its own commands
+        if (summary->count == 0) {
+            continue;
+        }
+        printf("%-16s %12lld %10lld %10.0f %10.0f %10.0f %10.0f %10.0f %10.0f", command_names[type], summary->count,
+               summary->errors, summary->ticks / ticks_per_ns / summary->count,
+               latency_percentile(summary, 0.5) / ticks_per_ns, latency_percentile(summary, 0.9) / ticks_per_ns,
+               latency_percentile(summary, 0.99) / ticks_per_ns, latency_percentile(summary, 0.999) / ticks_per_ns,
+               summary->max_ticks / ticks_per_ns);
+        const LatencySummary *before = &baseline[type];
+        if (before->count > 0) {
+            // Medians are compared at the upper end of their buckets, in each run's own clock
+            double median = latency_bucket_high(bucket_percentile(summary, 0.5)) / ticks_per_ns;
+            double base_median = latency_bucket_high(bucket_percentile(before, 0.5)) / baseline_ticks_per_ns;
+            double change = 100 * (median / base_median - 1);
+            double p_slower, p_faster;
+            mann_whitney(before, summary, &p_slower, &p_faster);
+            const char *verdict = "same";
+            if (p_slower < alpha && change > threshold) {
+                verdict = "REGRESSION";
+                regressions++;
+            } else if (p_faster < alpha && change < -threshold) {
+                verdict = "faster";
+            }
+            printf(" %12.0f %+8.2f%% %9.2g %s", base_median, change, change > 0 ? p_slower : p_faster, verdict);
+        } else if (compare_path) {
+            printf(" %12s", "no baseline");
+        }
+        printf("\n");
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Peak RSS: %.1f MiB\n", usage.ru_maxrss / 1024.0);  // Reported in KiB on Linux
+    fclose(output);
+    if (save_path && save_results(save_path, &workload, ticks_per_ns) < 0) {
+        return 1;
+    }
+    if (regressions) {
+        printf("%d regression%s against %s\n", regressions, regressions == 1 ? "" : "s", compare_path);
+        return 2;
+    }
+    return 0;
+}
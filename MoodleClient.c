@@ -0,0 +1,241 @@
+// Client library for the MoodleReplacement server, see MoodleClient.h
+#define _GNU_SOURCE  // Expose MSG_DONTWAIT and friends
+
+#include "MoodleClient.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_CLIENT_COMMAND_LENGTH 220  // Leaves room for the tag within the server's 256 byte lines
+#define RECEIVE_CHUNK 65536  // Bytes requested from the socket per read
+#define MAX_HEADER_LENGTH 64  // Longest "@TAG BYTES" response header, including the terminator
+
+// Structure to store a command waiting for its response
+typedef struct {
+    unsigned long long tag;  // Tag sent with the command
+    MoodleCallback callback;  // Called with the response, may be NULL
+    void *context;  // Passed to the callback
+} Pending;
+
+// Structure to store the state of one connection
+struct MoodleClient {
+    int fd;  // Connected socket
+    int max_in_flight;  // Most commands that may wait for a response
+    int batch_size;  // Queued commands that trigger a write
+    char *send_buffer;  // Commands queued but not written yet
+    size_t send_length;
+    size_t send_capacity;
+    int queued;  // Number of commands in the send buffer
+    char *receive_buffer;  // Bytes received but not delivered yet
+    size_t receive_length;
+    size_t receive_capacity;
+    Pending *pending;  // Ring of commands without a response, queued ones included
+    int pending_head;  // Oldest command in the ring
+    int pending_count;
+    unsigned long long next_tag;  // Tag of the next command
+};
+
+// Function to connect to a server
+MoodleClient *moodle_connect(const char *socket_path, int max_in_flight) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (max_in_flight < 1 || strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    MoodleClient *client = calloc(1, sizeof(MoodleClient));
+    if (!client) {
+        return NULL;
+    }
+    client->fd = -1;
+    client->max_in_flight = max_in_flight;
+    client->batch_size = max_in_flight > 1 ? max_in_flight / 2 : 1;  // Keep the pipe half full while writing
+    client->pending = calloc((size_t)max_in_flight, sizeof(Pending));
+    client->receive_capacity = RECEIVE_CHUNK;
+    client->receive_buffer = malloc(client->receive_capacity);
+    client->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!client->pending || !client->receive_buffer || client->fd < 0 ||
+        connect(client->fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        int saved_errno = errno;
+        moodle_close(client);
+        errno = saved_errno;
+        return NULL;
+    }
+    return client;
+}
+
+// Function to parse a "@TAG BYTES" response header without its newline, returns -1 if it is malformed
+static int parse_header(const char *header, size_t header_length, unsigned long long *tag, size_t *length) {
+    char copy[MAX_HEADER_LENGTH];  // The receive buffer is not terminated, so parse a terminated copy
+    if (header_length == 0 || header_length >= sizeof(copy) || header[0] != '@') {
+        return -1;
+    }
+    memcpy(copy, header, header_length);
+    copy[header_length] = '\0';
+    char *end;
+    *tag = strtoull(copy + 1, &end, 10);
+    if (end == copy + 1 || *end != ' ') {
+        return -1;
+    }
+    char *digits = end + 1;
+    *length = strtoull(digits, &end, 10);
+    return end == digits || *end != '\0' ? -1 : 0;
+}
+
+// Function to deliver every complete response in the receive buffer
+static int deliver_responses(MoodleClient *client) {
+    size_t start = 0;
+    while (start < client->receive_length) {
+        char *header_end = memchr(client->receive_buffer + start, '\n', client->receive_length - start);
+        if (!header_end) {
+            break;  // Header not complete yet
+        }
+        size_t body = (size_t)(header_end - client->receive_buffer) + 1;
+        unsigned long long tag;
+        size_t length;
+        if (client->pending_count == 0 ||
+            parse_header(client->receive_buffer + start, body - 1 - start, &tag, &length) < 0 ||
+            tag != client->pending[client->pending_head].tag) {
+            errno = EPROTO;  // The server answers in order, anything else is a protocol error
+            return -1;
+        }
+        if (client->receive_length - body < length) {
+            break;  // Body not complete yet
+        }
+        Pending *pending = &client->pending[client->pending_head];
+        client->pending_head = (client->pending_head + 1) % client->max_in_flight;
+        client->pending_count--;
+        if (pending->callback) {
+            pending->callback(pending->context, client->receive_buffer + body, length);
+        }
+        start = body + length;
+    }
+    memmove(client->receive_buffer, client->receive_buffer + start, client->receive_length - start);
+    client->receive_length -= start;
+    return 0;
+}
+
+// Function to read what the socket holds and deliver complete responses
+static int receive_responses(MoodleClient *client, int flags) {
+    if (client->receive_capacity - client->receive_length < RECEIVE_CHUNK) {
+        size_t capacity = client->receive_capacity * 2;  // A single response can be large
+        char *grown = realloc(client->receive_buffer, capacity);
+        if (!grown) {
+            return -1;
+        }
+        client->receive_buffer = grown;
+        client->receive_capacity = capacity;
+    }
+    ssize_t received = recv(client->fd, client->receive_buffer + client->receive_length,
+                            client->receive_capacity - client->receive_length, flags);
+    if (received < 0) {
+        return (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    if (received == 0) {
+        errno = ECONNRESET;  // The server closed the connection with responses outstanding
+        return -1;
+    }
+    client->receive_length += (size_t)received;
+    return deliver_responses(client);
+}
+
+// Function to write all queued commands, reading responses whenever the server pushes back
+static int flush_commands(MoodleClient *client) {
+    size_t sent = 0;
+    while (sent < client->send_length) {
+        ssize_t written = send(client->fd, client->send_buffer + sent, client->send_length - sent,
+                               MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written >= 0) {
+            sent += (size_t)written;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        // The server stops reading while we do not read its responses, so wait for both
+        struct pollfd poll_fd = {client->fd, POLLIN | POLLOUT, 0};
+        if (poll(&poll_fd, 1, -1) < 0 && errno != EINTR) {
+            return -1;
+        }
+        if ((poll_fd.revents & POLLIN) && receive_responses(client, MSG_DONTWAIT) < 0) {
+            return -1;
+        }
+    }
+    client->send_length = 0;
+    client->queued = 0;
+    return 0;
+}
+
+// Function to queue a command line
+int moodle_send(MoodleClient *client, const char *command, MoodleCallback callback, void *context) {
+    size_t length = strlen(command);
+    if (length > MAX_CLIENT_COMMAND_LENGTH || strchr(command, '\n')) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (client->pending_count == client->max_in_flight) {
+        // Pipeline is full: write what is queued, then wait for the oldest responses
+        int result = client->queued ? flush_commands(client) : receive_responses(client, 0);
+        if (result < 0) {
+            return -1;
+        }
+    }
+    if (client->send_capacity - client->send_length < length + 32) {
+        size_t capacity = client->send_capacity ? client->send_capacity * 2 : 4096;
+        while (capacity - client->send_length < length + 32) {
+            capacity *= 2;
+        }
+        char *grown = realloc(client->send_buffer, capacity);
+        if (!grown) {
+            return -1;
+        }
+        client->send_buffer = grown;
+        client->send_capacity = capacity;
+    }
+    unsigned long long tag = client->next_tag++;
+    client->send_length += (size_t)sprintf(client->send_buffer + client->send_length, "@%llu %s\n", tag, command);
+    Pending *pending = &client->pending[(client->pending_head + client->pending_count) % client->max_in_flight];
+    pending->tag = tag;
+    pending->callback = callback;
+    pending->context = context;
+    client->pending_count++;
+    if (++client->queued >= client->batch_size) {
+        return flush_commands(client);
+    }
+    return 0;
+}
+
+// Function to send every queued command and deliver all outstanding responses
+int moodle_wait(MoodleClient *client) {
+    if (client->queued && flush_commands(client) < 0) {
+        return -1;
+    }
+    while (client->pending_count > 0) {
+        if (receive_responses(client, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to close a connection
+void moodle_close(MoodleClient *client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+    }
+    free(client->send_buffer);
+    free(client->receive_buffer);
+    free(client->pending);
+    free(client);
+}
@@ -0,0 +1,27 @@
+// Client library for the MoodleReplacement server (MoodleReplacement --serve SOCKET_PATH).
+// Commands are tagged and pipelined: up to max_in_flight of them wait for a response at any time,
+// and queued commands are written to the socket in batches instead of one write per command.
+// Build: cc -O2 -c MoodleClient.c, and link MoodleClient.o into the program.
+#ifndef MOODLE_CLIENT_H
+#define MOODLE_CLIENT_H
+
+#include <stddef.h>
+
+// Function type called with the response of one command, it is not NUL terminated
+typedef void (*MoodleCallback)(void *context, const char *response, size_t length);
+
+typedef struct MoodleClient MoodleClient;  // Connection state, opaque to users
+
+// Function to connect to a server, returns NULL and sets errno on failure
+MoodleClient *moodle_connect(const char *socket_path, int max_in_flight);
+
+// Function to queue a command line without its newline, returns -1 and sets errno on failure
+int moodle_send(MoodleClient *client, const char *command, MoodleCallback callback, void *context);
+
+// Function to send every queued command and deliver all outstanding responses, returns -1 on failure
+int moodle_wait(MoodleClient *client);
+
+// Function to close a connection, responses that did not arrive yet are dropped
+void moodle_close(MoodleClient *client);
+
+#endif
@@ -0,0 +1,98 @@
+// Throughput of pipelined SEARCH_GRADE commands against a running server, for growing pipeline depths
+// Build: cc -O2 MoodleClientBenchmark.c MoodleClient.c -o MoodleClientBenchmark
+// Usage: ./MoodleClientBenchmark SOCKET_PATH [COMMANDS_PER_DEPTH] [MAX_DEPTH]
+#define _GNU_SOURCE
+
+#include "MoodleClient.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCHMARK_STUDENTS 100  // Students and exams created before measuring
+#define BENCHMARK_EXAMS 10
+
+// Function to get a monotonic time in seconds
+static double now_seconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Function to count the delivered responses
+static void count_response(void *context, const char *response, size_t length) {
+    (void)response;
+    (void)length;
+    (*(long *)context)++;
+}
+
+// Function to create the students, exams and grades the searches hit
+static int populate(const char *socket_path) {
+    MoodleClient *client = moodle_connect(socket_path, 256);
+    if (!client) {
+        return -1;
+    }
+    char command[128];
+    int result = 0;  // Stops at the first command that cannot be sent
+    for (int student = 1; student <= BENCHMARK_STUDENTS && result == 0; student++) {
+        snprintf(command, sizeof(command), "ADD_STUDENT %d Benchmark ComputerScience", student);
+        result = moodle_send(client, command, NULL, NULL);
+    }
+    for (int exam = 1; exam <= BENCHMARK_EXAMS && result == 0; exam++) {
+        snprintf(command, sizeof(command), "ADD_EXAM %d WRITTEN Benchmark", exam);
+        result = moodle_send(client, command, NULL, NULL);
+        for (int student = 1; student <= BENCHMARK_STUDENTS && result == 0; student++) {
+            snprintf(command, sizeof(command), "ADD_GRADE %d %d %d", exam, student, (exam * student) % 101);
+            result = moodle_send(client, command, NULL, NULL);
+        }
+    }
+    if (result == 0) {
+        result = moodle_wait(client);
+    }
+    int saved_errno = errno;  // Reported by the caller
+    moodle_close(client);
+    errno = saved_errno;
+    return result;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s SOCKET_PATH [COMMANDS_PER_DEPTH] [MAX_DEPTH]\n", argv[0]);
+        return 1;
+    }
+    long commands = argc > 2 ? atol(argv[2]) : 100000;
+    int max_depth = argc > 3 ? atoi(argv[3]) : 1024;
+    if (populate(argv[1]) < 0) {
+        perror("Failed to populate the server");
+        return 1;
+    }
+
+    printf("%8s %16s %14s\n", "depth", "commands/s", "us/command");
+    for (int depth = 1; depth <= max_depth; depth *= 2) {
+        MoodleClient *client = moodle_connect(argv[1], depth);
+        if (!client) {
+            perror("Failed to connect");
+            return 1;
+        }
+        long responses = 0;
+        char command[64];
+        double start = now_seconds();
+        for (long i = 0; i < commands; i++) {
+            snprintf(command, sizeof(command), "SEARCH_GRADE %ld %ld", i % BENCHMARK_EXAMS + 1,
+                     i % BENCHMARK_STUDENTS + 1);
+            if (moodle_send(client, command, count_response, &responses) < 0) {
+                perror("Failed to send");
+                return 1;
+            }
+        }
+        if (moodle_wait(client) < 0 || responses != commands) {
+            perror("Failed to receive");
+            return 1;
+        }
+        double elapsed = now_seconds() - start;
+        printf("%8d %16.0f %14.2f\n", depth, commands / elapsed, elapsed * 1e6 / commands);
+        moodle_close(client);
+    }
+    return 0;
+}
@@ -0,0 +1,500 @@
+// Microbenchmarks of the engine's hot paths: lookups, parsing, response formatting and deletion
+// Build: cc -O2 -pthread MoodleMicrobenchmark.c -o MoodleMicrobenchmark -lm
+// Usage: ./MoodleMicrobenchmark [--samples N] [--sample-ms MS] [--max-size N] [--save FILE]
+//        [--compare FILE] [--alpha P] [--threshold PERCENT] [BENCHMARK...]
+// --save writes the samples as a JSON baseline, --compare tests every benchmark and size against
+// one and exits with 2 if any got slower
+#ifndef MAX_STUDENTS
+#define MAX_STUDENTS (1 << 20)  // Room for the largest table size, untouched pages cost no memory
+#endif
+#ifndef MAX_EXAMS
+#define MAX_EXAMS 4096
+#endif
+#ifndef MAX_GRADES
+#define MAX_GRADES (1 << 21)
+#endif
+#define MOODLE_NO_MAIN  // Reuse the engine without its batch main()
+#include "MoodleReplacement.c"
+
+#include <time.h>
+
+#define WARMUP_SAMPLES 5  // Samples run and thrown away before measuring
+#define MAX_SAMPLES 1000  // Most samples per benchmark and size
+#define LOOKUP_IDS 4096  // IDs a lookup benchmark cycles through, a power of two
+#define GRADED_EXAMS (MAX_EXAMS < 1000 ? MAX_EXAMS : 1000)  // Exams the students of the table benchmarks are graded in
+#define MAX_RESULTS 64  // Most benchmark and size pairs in a run or a baseline
+#define MAX_BENCHMARK_NAME 32  // Longest benchmark name in a baseline, including the terminator
+
+// Structure to store a microbenchmark
+typedef struct {
+    const char *name;
+    long long (*run)(long iterations);  // Runs the operation, returns the nanoseconds it took
+    int scaled;  // TABLE_STUDENTS or TABLE_EXAMS if measured at every size of that table, TABLE_NONE if once
+} Microbenchmark;
+
+enum { TABLE_NONE, TABLE_STUDENTS, TABLE_EXAMS };  // Tables the benchmarks are scaled over
+
+// Structure to store the samples of one benchmark at one table size
+typedef struct {
+    char name[MAX_BENCHMARK_NAME];
+    int size;  // Table size, 0 for benchmarks that are not scaled
+    int count;
+    double per_operation[MAX_SAMPLES];  // Nanoseconds per operation of every sample, in measuring order
+} Result;
+
+static int samples = 30;  // Measured samples per benchmark and size
+static long long sample_nanoseconds = 20 * 1000000LL;  // Least duration of one sample
+static int table_size;  // Students or exams in the tables being measured
+static int lookup_ids[LOOKUP_IDS];  // Random IDs within the table
+static volatile long long sink;  // Results of the operations, so they are not optimized out
+static unsigned random_state = 2463534242u;
+static Result results[MAX_RESULTS];  // Results of this run, written by --save
+static int result_count = 0;
+static Result baseline[MAX_RESULTS];  // Results read by --compare
+static int baseline_count = -1;  // -1 without --compare
+static double alpha = 0.01;  // Significance level of the regression test
+static double threshold = 2;  // Least slowdown of the median in percent that counts as a regression
+static int regressions = 0;
+
+// Function to get a monotonic time in nanoseconds
+static long long now_nanoseconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+// Function to generate the next pseudo-random number
+static unsigned next_random(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+// Function to get the two-sided 95% quantile of Student's t distribution
+static double t_quantile(int degrees) {
+    static const double table[30] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131,
+        2.120,  2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    if (degrees <= 30) {
+        return table[degrees - 1];
+    }
+    return 1.960 + 2.37 / degrees;  // First terms of the Cornish-Fisher expansion around the normal quantile
+}
+
+// Function to compare two doubles for qsort
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Structure to store a sample in the ranking of the Mann-Whitney test
+typedef struct {
+    double value;
+    int current;  // 1 if the sample is from this run, 0 if from the baseline
+} RankedSample;
+
+// Function to compare ranked samples by value for qsort
+static int compare_ranked(const void *a, const void *b) {
+    return compare_doubles(&((const RankedSample *)a)->value, &((const RankedSample *)b)->value);
+}
+
+// Function to run the Mann-Whitney U test on the samples of a baseline and of this run. Sets the
+// one-sided p-values of this run being slower and of it being faster, from the normal
+// approximation with the tie and continuity corrections, which holds from about 8 samples each.
+static void mann_whitney(const Result *before, const Result *after, double *p_slower, double *p_faster) {
+    static RankedSample ranked[2 * MAX_SAMPLES];
+    int total = before->count + after->count;
+    for (int i = 0; i < before->count; i++) {
+        ranked[i] = (RankedSample){before->per_operation[i], 0};
+    }
+    for (int i = 0; i < after->count; i++) {
+        ranked[before->count + i] = (RankedSample){after->per_operation[i], 1};
+    }
+    qsort(ranked, (size_t)total, sizeof(RankedSample), compare_ranked);
+    double rank_sum = 0;  // Sum of the ranks of this run's samples, ties share their average rank
+    double ties = 0;  // Sum of t^3 - t over the groups of t tied samples
+    for (int start = 0, end; start < total; start = end) {
+        end = start + 1;
+        while (end < total && ranked[end].value == ranked[start].value) {
+            end++;
+        }
+        double rank = (start + 1 + end) / 2.0;
+        for (int i = start; i < end; i++) {
+            rank_sum += ranked[i].current ? rank : 0;
+        }
+        double tied = end - start;
+        ties += tied * tied * tied - tied;
+    }
+    double n1 = after->count, n2 = before->count;
+    double u = rank_sum - n1 * (n1 + 1) / 2;  // Pairs in which this run's sample is slower
+    double mean = n1 * n2 / 2;
+    double deviation = sqrt(n1 * n2 / 12 * ((total + 1) - ties / ((double)total * (total - 1))));
+    if (deviation == 0) {
+        *p_slower = *p_faster = 1;  // Every sample is equal
+        return;
+    }
+    *p_slower = 0.5 * erfc((u - mean - 0.5) / deviation / sqrt(2));
+    *p_faster = 0.5 * erfc((mean - u - 0.5) / deviation / sqrt(2));
+}
+
+// Function to find the result of a benchmark at a table size, NULL if there is none
+static const Result *find_result(const Result *list, int count, const char *name, int size) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(list[i].name, name) == 0 && list[i].size == size) {
+            return &list[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to write the results of this run as a JSON baseline, one result per line
+static int save_results(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("Failed to open baseline file");
+        return -1;
+    }
+    fprintf(file, "{\n\"samples\": %d,\n\"sample_ms\": %.3f,\n\"results\": [\n", samples, sample_nanoseconds / 1e6);
+    for (int i = 0; i < result_count; i++) {
+        fprintf(file, "{\"benchmark\": \"%s\", \"size\": %d, \"ns_per_op\": [", results[i].name, results[i].size);
+        for (int j = 0; j < results[i].count; j++) {
+            fprintf(file, "%s%.6g", j ? ", " : "", results[i].per_operation[j]);
+        }
+        fprintf(file, "]}%s\n", i + 1 < result_count ? "," : "");
+    }
+    fprintf(file, "]\n}\n");
+    if (fclose(file) != 0) {
+        perror("Failed to write baseline file");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to read a baseline written by save_results, returns -1 if it cannot be read
+static int load_baseline(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("Failed to open baseline file");
+        return -1;
+    }
+    baseline_count = 0;
+    char *line = NULL;
+    size_t capacity = 0;
+    int malformed = 0;
+    while (getline(&line, &capacity, file) > 0) {
+        const char *object = strstr(line, "{\"benchmark\"");
+        if (!object) {
+            continue;  // Header and footer lines
+        }
+        Result *result = &baseline[baseline_count];
+        const char *values = strchr(object, '[');
+        if (baseline_count == MAX_RESULTS || !values ||
+            sscanf(object, "{\"benchmark\": \"%31[^\"]\", \"size\": %d", result->name, &result->size) != 2) {
+            malformed = 1;
+            break;
+        }
+        result->count = 0;
+        char *end;
+        for (const char *cursor = values + 1; result->count < MAX_SAMPLES; cursor = end + 1) {
+            result->per_operation[result->count] = strtod(cursor, &end);
+            if (end == cursor) {
+                break;  // Empty list
+            }
+            result->count++;
+            if (*end != ',') {
+                break;
+            }
+        }
+        if (result->count < 2) {
+            malformed = 1;
+            break;
+        }
+        baseline_count++;
+    }
+    free(line);
+    fclose(file);
+    if (malformed) {
+        fprintf(stderr, "Malformed baseline file %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to add a student with one grade, the grade keeps the lists of every exam short
+static void add_graded_student(int id) {
+    add_student(id, "Benchmark", faculty_names[id % FACULTY_COUNT]);
+    add_grade(id % GRADED_EXAMS + 1, id, id % (MAX_GRADE + 1));
+}
+
+// Function to pick the random IDs the lookups cycle through
+static void pick_lookup_ids(int count) {
+    for (int i = 0; i < LOOKUP_IDS; i++) {
+        lookup_ids[i] = (int)(next_random() % (unsigned)count) + 1;
+    }
+}
+
+// Function to look up students by ID
+static long long run_find_student(long iterations) {
+    long long found = 0;
+    long long start = now_nanoseconds();
+    for (long i = 0; i < iterations; i++) {
+        int id = lookup_ids[i & (LOOKUP_IDS - 1)];
+        found += find_student(shard_of(id), id);
+    }
+    long long end = now_nanoseconds();
+    sink += found;
+    return end - start;
+}
+
+// Function to look up exams by ID
+static long long run_find_exam(long iterations) {
+    long long found = 0;
+    long long start = now_nanoseconds();
+    for (long i = 0; i < iterations; i++) {
+        found += find_exam(lookup_ids[i & (LOOKUP_IDS - 1)]);
+    }
+    long long end = now_nanoseconds();
+    sink += found;
+    return end - start;
+}
+
+// Function to parse a mix of command lines
+static long long run_parse_command(long iterations) {
+    static const char *lines[8] = {
+        "ADD_GRADE 17 4242 87\n", "SEARCH_STUDENT 4242\n", "SEARCH_GRADE 17 4242\n",
+        "ADD_STUDENT 4242 Benchmark ComputerScience\n", "UPDATE_GRADE 17 4242 91\n", "EXAM_STATS 17\n",
+        "UPDATE_EXAM 17 DIGITAL Benchmark\n", "DELETE_STUDENT 4242\n",
+    };
+    Command command;
+    long long parsed = 0;
+    long long start = now_nanoseconds();
+    for (long i = 0; i < iterations; i++) {
+        parse_command(lines[i & 7], &command);
+        parsed += command.id1;
+    }
+    long long end = now_nanoseconds();
+    sink += parsed;
+    return end - start;
+}
+
+// Function to format the response of SEARCH_STUDENT
+static long long run_format_student(long iterations) {
+    long long start = now_nanoseconds();
+    for (long i = 0; i < iterations; i++) {
+        fprintf(output, "ID: %d, Name: %s, Faculty: %s\n", (int)i, "Benchmark", "ComputerScience");
+    }
+    return now_nanoseconds() - start;
+}
+
+// Function to format the response of ADD_GRADE
+static long long run_format_grade(long iterations) {
+    long long start = now_nanoseconds();
+    for (long i = 0; i < iterations; i++) {
+        fprintf(output, "Grade %d added for the student: %d\n", (int)(i % (MAX_GRADE + 1)), (int)i);
+    }
+    return now_nanoseconds() - start;
+}
+
+// Function to delete students, each is added back with its grade outside of the measurement
+static long long run_delete_student(long iterations) {
+    long long elapsed = 0;
+    for (long i = 0; i < iterations; i++) {
+        int id = lookup_ids[i & (LOOKUP_IDS - 1)];
+        long long start = now_nanoseconds();
+        delete_student(id);
+        elapsed += now_nanoseconds() - start;
+        add_graded_student(id);
+    }
+    return elapsed;
+}
+
+static const Microbenchmark microbenchmarks[] = {
+    {"find_student", run_find_student, TABLE_STUDENTS},
+    {"find_exam", run_find_exam, TABLE_EXAMS},
+    {"parse_command", run_parse_command, TABLE_NONE},
+    {"format_student", run_format_student, TABLE_NONE},
+    {"format_grade", run_format_grade, TABLE_NONE},
+    {"delete_student", run_delete_student, TABLE_STUDENTS},
+};
+#define MICROBENCHMARK_COUNT (int)(sizeof(microbenchmarks) / sizeof(microbenchmarks[0]))
+
+// Function to measure one benchmark and print its ns/op with a 95% confidence interval
+static void measure(const Microbenchmark *benchmark) {
+    long iterations = 1;
+    long long elapsed;
+    while ((elapsed = benchmark->run(iterations)) < sample_nanoseconds / 8 && iterations < (1L << 40)) {
+        iterations *= 2;  // Calibrate, so timer resolution and overhead stay far below a sample
+    }
+    iterations = (long)((double)iterations * sample_nanoseconds / (elapsed > 0 ? elapsed : 1)) + 1;
+    for (int i = 0; i < WARMUP_SAMPLES; i++) {
+        benchmark->run(iterations);  // Warm caches, branch predictors and the CPU clock
+    }
+    double per_operation[MAX_SAMPLES];
+    double sum = 0;
+    for (int i = 0; i < samples; i++) {
+        per_operation[i] = (double)benchmark->run(iterations) / iterations;
+        sum += per_operation[i];
+    }
+    double mean = sum / samples;
+    double squares = 0;
+    for (int i = 0; i < samples; i++) {
+        squares += (per_operation[i] - mean) * (per_operation[i] - mean);
+    }
+    double interval = t_quantile(samples - 1) * sqrt(squares / (samples - 1)) / sqrt(samples);
+    Result *result = result_count < MAX_RESULTS ? &results[result_count++] : NULL;
+    if (result) {
+        snprintf(result->name, sizeof(result->name), "%s", benchmark->name);
+        result->size = benchmark->scaled ? table_size : 0;
+        result->count = samples;
+        memcpy(result->per_operation, per_operation, (size_t)samples * sizeof(double));
+    }
+    qsort(per_operation, (size_t)samples, sizeof(double), compare_doubles);
+    char size[16] = "-";
+    if (benchmark->scaled) {
+        snprintf(size, sizeof(size), "%d", table_size);
+    }
+    double median = per_operation[samples / 2];
+    printf("%-16s %9s %12.2f %10.2f %7.2f%% %12.2f %12.2f %12ld", benchmark->name, size, mean, interval,
+           100 * interval / mean, median, per_operation[0], iterations);
+    const Result *before = result ? find_result(baseline, baseline_count, result->name, result->size) : NULL;
+    if (before) {
+        double sorted[MAX_SAMPLES];
+        memcpy(sorted, before->per_operation, (size_t)before->count * sizeof(double));
+        qsort(sorted, (size_t)before->count, sizeof(double), compare_doubles);
+        double change = 100 * (median / sorted[before->count / 2] - 1);
+        double p_slower, p_faster;
+        mann_whitney(before, result, &p_slower, &p_faster);
+        const char *verdict = "same";
+        if (p_slower < alpha && change > threshold) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (p_faster < alpha && change < -threshold) {
+            verdict = "faster";
+        }
+        printf(" %12.2f %+8.2f%% %9.2g %s", sorted[before->count / 2], change, change > 0 ? p_slower : p_faster,
+               verdict);
+    } else if (baseline_count >= 0) {
+        printf(" %12s", "no baseline");
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+// Function to measure the benchmarks of a kind that were selected on the command line, no names select all
+static void measure_selected(int scaled, char **names, int name_count) {
+    for (int i = 0; i < MICROBENCHMARK_COUNT; i++) {
+        int wanted = name_count == 0;
+        for (int j = 0; j < name_count; j++) {
+            wanted |= strcmp(names[j], microbenchmarks[i].name) == 0;
+        }
+        if (wanted && microbenchmarks[i].scaled == scaled) {
+            measure(&microbenchmarks[i]);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int max_size = 100000;
+    const char *save_path = NULL;  // Write the results as a JSON baseline here
+    const char *compare_path = NULL;  // Compare the results with this JSON baseline
+    char *names[MICROBENCHMARK_COUNT + 1];
+    int name_count = 0;
+    int usage_error = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sample-ms") == 0 && i + 1 < argc) {
+            sample_nanoseconds = (long long)(strtod(argv[++i], NULL) * 1000000);
+        } else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) {
+            max_size = (int)strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            compare_path = argv[++i];
+        } else if (strcmp(argv[i], "--alpha") == 0 && i + 1 < argc) {
+            alpha = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = strtod(argv[++i], NULL);
+        } else if (name_count < MICROBENCHMARK_COUNT) {
+            names[name_count++] = argv[i];
+            int known = 0;
+            for (int j = 0; j < MICROBENCHMARK_COUNT; j++) {
+                known |= strcmp(microbenchmarks[j].name, argv[i]) == 0;
+            }
+            usage_error |= !known;
+        } else {
+            usage_error = 1;
+        }
+    }
+    if (usage_error || samples < 2 || samples > MAX_SAMPLES || sample_nanoseconds <= 0 || max_size < 100 ||
+        max_size > MAX_STUDENTS || alpha <= 0 || alpha >= 1 || threshold < 0) {
+        fprintf(stderr, "Usage: %s [--samples 2..%d] [--sample-ms MS] [--max-size 100..%d] [--save FILE]\n"
+                        "       [--compare FILE] [--alpha 0..1] [--threshold PERCENT] [BENCHMARK...]\n",
+                argv[0], MAX_SAMPLES, MAX_STUDENTS);
+        fprintf(stderr, "Benchmarks:");
+        for (int i = 0; i < MICROBENCHMARK_COUNT; i++) {
+            fprintf(stderr, " %s", microbenchmarks[i].name);
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    if (compare_path && load_baseline(compare_path) < 0) {
+        return 1;
+    }
+    if (init_shards(1) < 0) {  // One shard, so the table sizes are the sizes a lookup sees
+        fprintf(stderr, "Failed to allocate the tables\n");
+        return 1;
+    }
+    output = fopen("/dev/null", "w");  // Responses are formatted but thrown away
+    setvbuf(output, NULL, _IOFBF, 1 << 16);
+
+    printf("%d samples of at least %.1f ms after %d warmup samples, 95%% confidence intervals\n", samples,
+           sample_nanoseconds / 1e6, WARMUP_SAMPLES);
+    if (compare_path) {
+        printf("Compared with %s: one-sided Mann-Whitney U test at alpha %g, median slowdown over %g%%\n",
+               compare_path, alpha, threshold);
+    }
+    printf("%-16s %9s %12s %10s %8s %12s %12s %12s", "benchmark", "size", "mean ns/op", "+- ns", "+- %",
+           "median ns", "min ns", "ops/sample");
+    if (compare_path) {
+        printf(" %12s %9s %9s %s", "base median", "change", "p", "verdict");
+    }
+    printf("\n");
+    measure_selected(TABLE_NONE, names, name_count);
+    // Tables only grow, exams first as the students are graded in the first GRADED_EXAMS of them
+    static const int exam_sizes[] = {10, 100, GRADED_EXAMS, MAX_EXAMS};
+    for (int i = 0; i < 4; i++) {
+        if (exam_sizes[i] > MAX_EXAMS || exam_sizes[i] <= exam_count) {
+            continue;  // Larger than the table, or measured already when MAX_EXAMS is one of the sizes
+        }
+        table_size = exam_sizes[i];
+        while (exam_count < table_size) {
+            int added = exam_count;
+            add_exam(exam_count + 1, "WRITTEN", "Benchmark");
+            if (exam_count == added) {
+                fprintf(stderr, "Could not add exam %d\n", exam_count + 1);
+                return 1;  // The loop would never end
+            }
+        }
+        pick_lookup_ids(table_size);
+        measure_selected(TABLE_EXAMS, names, name_count);
+    }
+    for (table_size = 100; table_size <= max_size; table_size *= 10) {
+        while (student_count < table_size) {
+            add_graded_student(student_count + 1);
+        }
+        pick_lookup_ids(table_size);
+        measure_selected(TABLE_STUDENTS, names, name_count);
+    }
+    fclose(output);
+    if (save_path && save_results(save_path) < 0) {
+        return 1;
+    }
+    if (regressions) {
+        printf("%d regression%s against %s\n", regressions, regressions == 1 ? "" : "s", compare_path);
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,167 @@
+// Read-scaling benchmark for the SEARCH_* commands running next to a busy UPDATE_GRADE writer
+// Build: cc -O2 -pthread MoodleReadBenchmark.c -o MoodleReadBenchmark -lm
+// Usage: ./MoodleReadBenchmark [MAX_READER_THREADS] [--locked] [--reads-per-write N]
+#define MOODLE_NO_MAIN  // Reuse the engine without its batch main()
+#include "MoodleReplacement.c"
+
+#include <time.h>
+
+#define BENCHMARK_SECONDS 1.0  // Measuring time for each thread count
+#define MAX_READERS 64  // Maximum number of reader threads
+
+static atomic_int benchmark_running;  // Cleared when the measuring time is over
+static int readers_take_lock = 0;  // --locked: readers hold the shard lock, the design seqlocks replace
+static int reads_per_write = 50;  // Command mix, 0 lets the writer run unthrottled
+static atomic_llong total_reads;  // Reads completed by all readers, paces the writer
+
+// Structure to store the result of one benchmark thread
+typedef struct {
+    unsigned seed;  // Per-thread random state
+    long long operations;  // Number of commands executed
+} Worker;
+
+#define READ_REPORT_INTERVAL 64  // Readers publish their count to total_reads this often
+
+// Function to get a monotonic time in seconds
+static double now_seconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Function to generate the next pseudo-random number of a thread
+static unsigned next_random(unsigned *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// Function to run SEARCH_GRADE and SEARCH_STUDENT until the measurement ends
+static void *reader_thread(void *argument) {
+    Worker *worker = argument;
+    output = fopen("/dev/null", "w");  // Responses are formatted but thrown away
+    while (atomic_load_explicit(&benchmark_running, memory_order_relaxed)) {
+        unsigned value = next_random(&worker->seed);
+        int student_id = value % MAX_STUDENTS + 1;
+        int exam_id = (value >> 8) % MAX_EXAMS + 1;
+        Shard *shard = shard_of(student_id);
+        if (readers_take_lock) {
+            pthread_mutex_lock(&shard->lock.mutex);
+        }
+        if (value & 1) {
+            search_grade(exam_id, student_id);
+        } else {
+            search_student(student_id);
+        }
+        if (readers_take_lock) {
+            pthread_mutex_unlock(&shard->lock.mutex);
+        }
+        if (++worker->operations % READ_REPORT_INTERVAL == 0) {
+            atomic_fetch_add_explicit(&total_reads, READ_REPORT_INTERVAL, memory_order_relaxed);
+        }
+    }
+    fclose(output);
+    return NULL;
+}
+
+// Function to run UPDATE_GRADE at the configured share of the reads until the measurement ends
+static void *writer_thread(void *argument) {
+    Worker *worker = argument;
+    output = fopen("/dev/null", "w");
+    while (atomic_load_explicit(&benchmark_running, memory_order_relaxed)) {
+        if (reads_per_write > 0 &&
+            worker->operations * reads_per_write >= atomic_load_explicit(&total_reads, memory_order_relaxed)) {
+            sched_yield();  // Ahead of the command mix, wait for the readers
+            continue;
+        }
+        unsigned value = next_random(&worker->seed);
+        int student_id = value % MAX_STUDENTS + 1;
+        write_begin(&shard_of(student_id)->lock);
+        update_grade((value >> 8) % MAX_EXAMS + 1, student_id, value % 101);
+        write_end(&shard_of(student_id)->lock);
+        worker->operations++;
+    }
+    fclose(output);
+    return NULL;
+}
+
+// Function to fill every table to its capacity
+static void populate(void) {
+    output = fopen("/dev/null", "w");
+    for (int id = 1; id <= MAX_STUDENTS; id++) {
+        add_student(id, "Student", "ComputerScience");
+    }
+    for (int id = 1; id <= MAX_EXAMS; id++) {
+        add_exam(id, "WRITTEN", "Benchmark");
+    }
+    for (int exam_id = 1; exam_id <= MAX_EXAMS; exam_id++) {
+        for (int student_id = 1; student_id <= MAX_STUDENTS; student_id++) {
+            add_grade(exam_id, student_id, (exam_id * student_id) % 101);
+        }
+    }
+    fclose(output);
+}
+
+int main(int argc, char **argv) {
+    int max_readers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--locked") == 0) {
+            readers_take_lock = 1;
+        } else if (strcmp(argv[i], "--reads-per-write") == 0 && i + 1 < argc) {
+            reads_per_write = atoi(argv[++i]);
+        } else {
+            max_readers = atoi(argv[i]);
+        }
+    }
+    if (max_readers < 1 || max_readers > MAX_READERS) {
+        fprintf(stderr, "Usage: %s [1..%d reader threads] [--locked] [--reads-per-write N]\n", argv[0],
+                MAX_READERS);
+        return 1;
+    }
+    if (init_shards(1) < 0) {  // One shard, so every read races with the writer
+        fprintf(stderr, "Failed to allocate the tables\n");
+        return 1;
+    }
+    populate();
+
+    printf("%s readers, one UPDATE_GRADE writer (%d reads per write, 0 = unthrottled), %d students, %d grades\n",
+           readers_take_lock ? "Locked" : "Seqlock", reads_per_write, student_count, grade_count);
+    printf("%8s %16s %10s %16s\n", "readers", "reads/s", "speedup", "writes/s");
+    double single_reader_rate = 0;
+    for (int readers = 1;; readers = readers * 2 < max_readers ? readers * 2 : max_readers) {
+        pthread_t threads[MAX_READERS + 1];
+        Worker workers[MAX_READERS + 1];
+        atomic_store(&benchmark_running, 1);
+        atomic_store(&total_reads, 0);
+        for (int i = 0; i <= readers; i++) {
+            workers[i].seed = 2463534242u + i * 7919u;
+            workers[i].operations = 0;
+            pthread_create(&threads[i], NULL, i == readers ? writer_thread : reader_thread, &workers[i]);
+        }
+        double start = now_seconds();
+        struct timespec pause = {0, 10 * 1000 * 1000};
+        while (now_seconds() - start < BENCHMARK_SECONDS) {
+            nanosleep(&pause, NULL);
+        }
+        atomic_store(&benchmark_running, 0);
+        long long reads = 0;
+        for (int i = 0; i <= readers; i++) {
+            pthread_join(threads[i], NULL);
+            if (i < readers) {
+                reads += workers[i].operations;
+            }
+        }
+        double elapsed = now_seconds() - start;
+        double read_rate = reads / elapsed;
+        if (readers == 1) {
+            single_reader_rate = read_rate;
+        }
+        printf("%8d %16.0f %9.2fx %16.0f\n", readers, read_rate, read_rate / single_reader_rate,
+               workers[readers].operations / elapsed);
+        if (readers == max_readers) {
+            break;  // Doubling always ends with the requested maximum
+        }
+    }
+    return 0;
+}
@@ -1,20 +1,111 @@
+// Build: cc -O2 -pthread MoodleReplacement.c -o MoodleReplacement -lm
+#define _GNU_SOURCE  // Expose open_memstream, accept4 and friends
+
 #include <stdio.h>  // Include standard libraries that we need
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>  // USDT probes, from systemtap-sdt-dev or systemtap-sdt-devel
+#endif
+#endif
+
+// USDT probes for bpftrace and perf. A probe compiles to a single nop and a note in the binary
+// until a tracer attaches to it, and to nothing when sys/sdt.h is not installed.
+//   moodle:command_entry(type, line)  before a command runs
+//   moodle:command_return(type, failed, ticks)  after it ran, ticks as counted by read_ticks()
+//   moodle:student_added(id, shard students, students)
+//   moodle:grade_added(exam id, student id, grade, shard grades, grades)
+//   moodle:grade_updated(exam id, student id, old grade, new grade, shard grades)
+//   moodle:student_deleted(id, grades removed, shard students, shard grades)
+// e.g. bpftrace -e 'usdt:./MoodleReplacement:moodle:command_return { @[arg0] = hist(arg2); }'
+#ifdef DTRACE_PROBE2
+#define MOODLE_PROBE2(name, a, b) DTRACE_PROBE2(moodle, name, a, b)
+#define MOODLE_PROBE3(name, a, b, c) DTRACE_PROBE3(moodle, name, a, b, c)
+#define MOODLE_PROBE4(name, a, b, c, d) DTRACE_PROBE4(moodle, name, a, b, c, d)
+#define MOODLE_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(moodle, name, a, b, c, d, e)
+#else
+#define MOODLE_PROBE_ARGUMENT(a) (void)sizeof(a)  // Type-checked, not evaluated
+#define MOODLE_PROBE2(name, a, b) (MOODLE_PROBE_ARGUMENT(a), MOODLE_PROBE_ARGUMENT(b))
+#define MOODLE_PROBE3(name, a, b, c) (MOODLE_PROBE2(name, a, b), MOODLE_PROBE_ARGUMENT(c))
+#define MOODLE_PROBE4(name, a, b, c, d) (MOODLE_PROBE3(name, a, b, c), MOODLE_PROBE_ARGUMENT(d))
+#define MOODLE_PROBE5(name, a, b, c, d, e) (MOODLE_PROBE4(name, a, b, c, d), MOODLE_PROBE_ARGUMENT(e))
+#endif
 
+#ifndef MAX_STUDENTS  // Table sizes may be overridden at build time, e.g. -DMAX_STUDENTS=1000000
 #define MAX_STUDENTS 100  // Define maximum number of students
+#endif
+#ifndef MAX_EXAMS
 #define MAX_EXAMS 100     // Define maximum number of exams
+#endif
 #define MAX_NAME_LENGTH 100  // Define maximum length for student name
 #define MAX_FACULTY_LENGTH 100  // Define maximum length for faculty name
 #define MAX_TYPE_LENGTH 20  // Define maximum length for exam type
 #define MAX_COMMAND_LENGTH 256  // Define maximum length for command
+#define MAX_EVENTS 1024  // Maximum number of epoll events handled per wakeup
+#define CONNECTION_BUFFER_SIZE 65536  // Size of the per-connection input buffer
+#define MAX_PENDING_OUTPUT (1 << 20)  // Stop reading from a client whose unsent output exceeds this
+#define MAX_SERVER_THREADS 256  // Maximum number of server event loop threads
+#define MAX_TAG_LENGTH 32  // Maximum length of a request tag, including the terminator
+#define MAX_OPTIMISTIC_READS 8  // Lock-free read attempts before a reader falls back to the lock
+#define MAX_SHARDS 64  // Maximum number of student shards
+#ifndef MAX_GRADES
+#define MAX_GRADES (MAX_EXAMS * MAX_STUDENTS)  // Maximum number of grades
+#endif
+#define MAX_GRADE 100  // Grades are bounded to 0..MAX_GRADE
+#define PASS_GRADE 60  // Lowest passing grade
+#define FACULTY_COUNT 6  // Number of faculties in faculty_names
+#define CONTAINER_WORDS 1024  // 64-bit words of a bitset container, one bit per low 16-bit value
+#define ARRAY_CONTAINER_LIMIT 4096  // Containers holding more values than this are bitsets
+#define MAX_QUERY_TERMS 64  // Most sets a QUERY command combines
+#define EXPORT_ROW_LENGTH 512  // Room reserved for one gradebook row, quoting included
+#define CORRELATION_BLOCK 4096  // Students per block of the correlation kernel, keeps its int sums in range
+#define BATCH_WINDOW 4096  // Commands analysed and applied together by the parallel batch executor
+#define BATCH_MAX_KEYS 2  // Most keys a single command reads or writes
+#define BATCH_KEY_SLOTS 16384  // Hash table slots for the keys of a window, a power of two
+#define LATENCY_SUB_BUCKETS 32  // Latency histogram buckets per power of two, within about 3% of any latency
+#define LATENCY_MAX_SHIFT 35  // Latencies of 2^41 ticks and more share the last bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_SHIFT + 2) * LATENCY_SUB_BUCKETS)
+#define TRACE_EVENTS_PER_THREAD (1 << 20)  // Trace events a thread keeps, later ones are dropped
+#define PERF_COUNTERS 4  // Hardware counters read around every command with --perf-counters
+#define SLOWLOG_ENTRIES 128  // Slow commands kept by the slowlog, older ones are overwritten
+#define DEFAULT_SLOWLOG_THRESHOLD 10000  // Commands slower than this many microseconds are logged
+#define MEMORY_MINCORE_BYTES (128 * 1024)  // Allocations this large get their own pages, mincore() measures them
 
 // Structure to store student data
 typedef struct {
     int id;  // Student ID
     char name[MAX_NAME_LENGTH];  // Student name
     char faculty[MAX_FACULTY_LENGTH];  // Faculty name
+    long long order;  // Global insertion order, LIST_ALL_STUDENTS merges the shards by it
+    int graded;  // Number of grades of the student
+    long long weighted_sum;  // Sum of the grades times the weights of their exams
+    long long weight_sum;  // Sum of the weights of the exams of the grades
+    int first_grade;  // Head of the student's transcript list, -1 without grades
 } Student;
 
 // Structure to store exam data
@@ -22,35 +113,381 @@ typedef struct {
     int id;  // Exam ID
     char type[MAX_TYPE_LENGTH];  // Exam type (e.g., WRITTEN or DIGITAL)
     char info[MAX_NAME_LENGTH];  // Additional exam information
+    int weight;  // Weight in student averages, changed only while every shard is locked
 } Exam;
 
+// Lists every grade belongs to, the ones that depend on the grade value come first
+// and the ones kept in search trees before the transcripts
+enum {
+    LIST_EXAM,
+    LIST_FACULTY,
+    VALUE_LIST_COUNT,
+    LIST_ROSTER = VALUE_LIST_COUNT,
+    LIST_TRANSCRIPT,
+    INDEXED_LIST_COUNT = LIST_TRANSCRIPT,
+    LIST_COUNT
+};
+
+// Structure to store the neighbours of a grade in one of its lists, -1 at the ends
+typedef struct {
+    int prev;
+    int next;
+} GradeLink;
+
+// Structure to store the position of a grade in the search tree over one of its lists, -1 where absent
+typedef struct {
+    int left;
+    int right;
+    int parent;
+} GradeNode;
+
 // Structure to store grade data
 typedef struct {
     int exam_id;  // Exam ID
     int student_id;  // Student ID
     int grade;  // Grade value
+    int exam_index;  // Position of the exam in exams[], exams are never removed
+    int faculty_index;  // Faculty of the student in faculty_names
+    GradeLink links[LIST_COUNT];  // Position in the leaderboards, the exam roster and the student transcript
+    GradeNode nodes[INDEXED_LIST_COUNT];  // Position in the search trees over the leaderboards and the roster
 } Grade;
 
-Student students[MAX_STUDENTS];  // Array to store students
-Exam exams[MAX_EXAMS];  // Array to store exams
-Grade grades[MAX_EXAMS * MAX_STUDENTS];  // Array to store grades
+// Structure to store the running aggregates of one exam, kept per shard and merged on query
+typedef struct {
+    int count;  // Number of grades
+    long long sum;  // Sum of the grades
+    int passed;  // Number of grades of at least PASS_GRADE
+    int tree[MAX_GRADE + 2];  // Fenwick tree counting the grades per value, grade g at index g + 1
+} ExamStats;
+
+// Student sets are compressed bitmaps in the style of Roaring: values are grouped by their high
+// 16 bits into containers, and a container stores its low 16 bits as a sorted array while it is
+// sparse and as a 65536 bit bitset once it holds more than ARRAY_CONTAINER_LIMIT values.
+// Both forms take at most 8 KiB, and set operations on bitsets are plain word loops that the
+// compiler vectorizes.
+
+// Structure to store the values of a bitmap sharing their high 16 bits
+typedef struct {
+    uint16_t key;  // High 16 bits of the values
+    int cardinality;  // Number of values
+    uint16_t *array;  // Sorted low 16 bits while the container is sparse, NULL otherwise
+    uint64_t *words;  // Bitset of the low 16 bits while the container is dense, NULL otherwise
+} Container;
+
+// Structure to store a set of 32-bit values
+typedef struct {
+    Container *containers;  // Non-empty containers sorted by key
+    int count;
+    int capacity;
+} Bitmap;
+
+// Writers of a table are serialized by its mutex and bump its sequence around every mutation.
+// Readers normally never take the mutex: they copy what they need and retry if a writer ran
+// meanwhile, so reads scale across cores and do not wait on writers. A reader that keeps
+// losing against writers takes the mutex once so it cannot starve. The tables are fixed
+// arrays, so a racing reader can see stale values but never reads outside of them.
+typedef struct {
+    pthread_mutex_t mutex;  // Serializes writers
+    atomic_uint sequence;  // Odd while a writer is modifying the table
+} SeqLock;
+
+typedef struct ShardTask ShardTask;  // Command queued for the worker that owns a shard, see the server
 
-int student_count = 0;  // Number of students added
+// Every grade of a shard is linked into four lists, each sorted by student and exam ID: the
+// leaderboards of its exam and grade value and of its student's faculty and grade value, the
+// roster of its exam and the transcript of its student. Reading the leaderboards from MAX_GRADE
+// down gives the best grades without sorting the grade table, and rosters and transcripts are
+// read in time proportional to their length. Transcripts are short and kept sorted by a linear
+// insert, lock-free readers look up grades in them. Leaderboards and rosters can hold every grade
+// of an exam, so each is also a treap over the same grades: a write finds the neighbours of a
+// grade in O(log n) and keeps the list sorted, and a read only follows links, whatever the
+// size of the exam. The treap priority is a hash of the student and exam ID, so it survives
+// grade_move and costs no memory.
+
+// Students are partitioned into shards by ID. A shard holds its students and all of their
+// grades, so every command about one student touches exactly one shard. In server mode each
+// shard is owned by a worker thread that applies its writes in queue order.
+typedef struct {
+    _Alignas(64) SeqLock lock;  // Guards the tables below, own cache line to avoid false sharing
+    Student *students;  // Students of this shard in insertion order
+    int student_count;  // Number of students in this shard
+    Grade *grades;  // Grades of this shard's students in insertion order
+    int grade_count;  // Number of grades in this shard
+    ExamStats *exam_stats;  // Aggregates of this shard's grades, indexed like exams[]
+    int *student_slots;  // Open-addressing index from student ID to position in students, -1 if empty
+    int *leaderboards[VALUE_LIST_COUNT];  // First grade per exam or faculty and grade value, -1 if none
+    int *rosters;  // First grade per exam, indexed like exams[]
+    int *list_roots[INDEXED_LIST_COUNT];  // Tree root of every leaderboard and roster, -1 if empty
+    Bitmap faculty_members[FACULTY_COUNT];  // IDs of the shard's students per faculty
+    Bitmap *passed;  // IDs of the shard's students with a passing grade, indexed like exams[]
+    pthread_mutex_t queue_lock;  // Guards the task queue
+    pthread_cond_t queue_ready;  // Signalled when a task is queued
+    ShardTask *queue_head;  // Oldest queued task
+    ShardTask *queue_tail;  // Newest queued task
+    pthread_t worker;  // Thread owning this shard in server mode
+} Shard;
+
+Shard shards[MAX_SHARDS];  // Student partitions
+int shard_count = 0;  // Number of shards in use
+Exam exams[MAX_EXAMS];  // Array to store exams, shared read-mostly by all shards
+SeqLock exam_lock = {PTHREAD_MUTEX_INITIALIZER, 0};  // Guards the exam table
+
+int student_slot_bits = 0;  // The student index of a shard has 1 << student_slot_bits slots
+atomic_int student_count = 0;  // Number of students added, over all shards
 int exam_count = 0;  // Number of exams added
-int grade_count = 0;  // Number of grades added
+atomic_int grade_count = 0;  // Number of grades added, over all shards
+atomic_llong student_order = 0;  // Source of Student.order
+_Thread_local long long reserved_order = -1;  // Order taken when a command was queued, -1 if none
+int command_threads = 1;  // Threads a single command may split its work over, from --threads
+
+_Thread_local FILE *output;  // Output file pointer, each server thread writes its own responses
+_Thread_local int command_failed;  // Set once the running command reported an error, counted by STATS
+
+const char *faculty_names[FACULTY_COUNT] = {
+    "SoftwareEngineering", "ComputerScience", "DataScience",
+    "CyberSecurity", "InformationTechnology", "ProgrammingLanguagesAndCompilers",
+};
+
+unsigned long long clock_start_ticks;  // read_ticks() when the tables were allocated
+long long clock_start_nanoseconds;  // CLOCK_MONOTONIC at the same time, to convert ticks to time
+
+// Function to read a cheap timestamp: the invariant time stamp counter on x86, nanoseconds elsewhere
+unsigned long long read_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000ULL + time.tv_nsec;
+#endif
+}
+
+// Function to get CLOCK_MONOTONIC in nanoseconds
+long long monotonic_nanoseconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+// Function to remember when the program started, ticks are converted to time against it
+void latency_clock_start(void) {
+    clock_start_ticks = read_ticks();
+    clock_start_nanoseconds = monotonic_nanoseconds();
+}
+
+// Function to get the ticks per nanosecond, measured over the whole run instead of at startup
+double ticks_per_nanosecond(void) {
+    long long elapsed;
+    while ((elapsed = monotonic_nanoseconds() - clock_start_nanoseconds) < 1000000) {
+        // Wait out the first millisecond, so the clocks' resolution does not skew the ratio
+    }
+    return (double)(read_ticks() - clock_start_ticks) / elapsed;
+}
+
+// Function to write the error response of the running command
+__attribute__((format(printf, 1, 2))) void report_error(const char *format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    vfprintf(output, format, arguments);
+    va_end(arguments);
+    command_failed = 1;
+}
+
+// Function to get the number of indexed lists of a kind: one per exam or faculty and grade value for the
+// leaderboards, one per exam for the rosters
+size_t list_slot_count(int list) {
+    if (list == LIST_ROSTER) {
+        return MAX_EXAMS;
+    }
+    return (size_t)(list == LIST_EXAM ? MAX_EXAMS : FACULTY_COUNT) * (MAX_GRADE + 1);
+}
+
+// Function to get the heads of the indexed lists of a kind
+int *list_heads(Shard *shard, int list) {
+    return list == LIST_ROSTER ? shard->rosters : shard->leaderboards[list];
+}
+
+// Function to allocate the shard tables, returns -1 when memory runs out
+int init_shards(int count) {
+    latency_clock_start();
+    shard_count = count;
+    student_slot_bits = 1;
+    while ((1 << student_slot_bits) < 2 * MAX_STUDENTS) {
+        student_slot_bits++;  // At most half full, so probe chains stay short
+    }
+    for (int i = 0; i < count; i++) {
+        Shard *shard = &shards[i];
+        pthread_mutex_init(&shard->lock.mutex, NULL);
+        pthread_mutex_init(&shard->queue_lock, NULL);
+        pthread_cond_init(&shard->queue_ready, NULL);
+        // Any shard may receive every student, untouched pages cost no memory
+        shard->students = calloc(MAX_STUDENTS, sizeof(Student));
+        shard->grades = calloc(MAX_GRADES, sizeof(Grade));
+        shard->exam_stats = calloc(MAX_EXAMS, sizeof(ExamStats));
+        shard->passed = calloc(MAX_EXAMS, sizeof(Bitmap));
+        shard->student_slots = malloc(sizeof(int) << student_slot_bits);
+        shard->rosters = malloc(MAX_EXAMS * sizeof(int));
+        if (!shard->students || !shard->grades || !shard->exam_stats || !shard->passed || !shard->student_slots ||
+            !shard->rosters) {
+            return -1;
+        }
+        memset(shard->student_slots, -1, sizeof(int) << student_slot_bits);
+        memset(shard->rosters, -1, MAX_EXAMS * sizeof(int));
+        for (int list = 0; list < INDEXED_LIST_COUNT; list++) {
+            size_t slots = list_slot_count(list);
+            if (list < VALUE_LIST_COUNT) {
+                shard->leaderboards[list] = malloc(slots * sizeof(int));
+                if (!shard->leaderboards[list]) {
+                    return -1;
+                }
+                memset(shard->leaderboards[list], -1, slots * sizeof(int));
+            }
+            shard->list_roots[list] = malloc(slots * sizeof(int));
+            if (!shard->list_roots[list]) {
+                return -1;
+            }
+            memset(shard->list_roots[list], -1, slots * sizeof(int));
+        }
+    }
+    return 0;
+}
+
+// Function to find the shard that owns a student
+Shard *shard_of(int student_id) {
+    return &shards[((unsigned)student_id * 2654435761u) % (unsigned)shard_count];  // Spread sequential IDs
+}
+
+// Function to start a table mutation
+void write_begin(SeqLock *lock) {
+    pthread_mutex_lock(&lock->mutex);
+    atomic_store_explicit(&lock->sequence, atomic_load_explicit(&lock->sequence, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);  // Readers must see the odd value before any change
+}
+
+// Function to finish a table mutation
+void write_end(SeqLock *lock) {
+    atomic_store_explicit(&lock->sequence, atomic_load_explicit(&lock->sequence, memory_order_relaxed) + 1,
+                          memory_order_release);
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+// Function to start an optimistic read, waits while a writer is inside
+unsigned read_begin(SeqLock *lock, int attempts) {
+    if (attempts >= MAX_OPTIMISTIC_READS) {
+        pthread_mutex_lock(&lock->mutex);  // Writers keep winning, read under the lock so we finish
+        return atomic_load_explicit(&lock->sequence, memory_order_relaxed);
+    }
+    for (;;) {
+        unsigned sequence = atomic_load_explicit(&lock->sequence, memory_order_acquire);
+        if (!(sequence & 1)) {
+            return sequence;
+        }
+        sched_yield();  // Let the writer finish instead of spinning on its cache line
+    }
+}
+
+// Function to check whether an optimistic read raced with a writer and must be repeated
+int read_retry(SeqLock *lock, unsigned sequence, int attempts) {
+    if (attempts >= MAX_OPTIMISTIC_READS) {
+        pthread_mutex_unlock(&lock->mutex);
+        return 0;
+    }
+    atomic_thread_fence(memory_order_acquire);  // Order the data reads before the re-check
+    return atomic_load_explicit(&lock->sequence, memory_order_relaxed) != sequence;
+}
+
+// Function to lock every shard, in index order so that it cannot deadlock
+void lock_all_shards(void) {
+    for (int i = 0; i < shard_count; i++) {
+        pthread_mutex_lock(&shards[i].lock.mutex);
+    }
+}
+
+// Function to unlock every shard
+void unlock_all_shards(void) {
+    for (int i = shard_count - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&shards[i].lock.mutex);
+    }
+}
+
+// Function to start a mutation of every shard
+void write_begin_all_shards(void) {
+    for (int i = 0; i < shard_count; i++) {
+        write_begin(&shards[i].lock);
+    }
+}
+
+// Function to finish a mutation of every shard
+void write_end_all_shards(void) {
+    for (int i = shard_count - 1; i >= 0; i--) {
+        write_end(&shards[i].lock);
+    }
+}
 
-FILE *output;  // Output file pointer
+// Function to get the first index slot of a student ID
+unsigned student_slot(int id) {
+    return ((unsigned)id * 0x85EBCA6Bu) >> (32 - student_slot_bits);  // Other bits than shard_of uses
+}
 
-// Function to find a student by ID
-int find_student(int id) {
-    for (int i = 0; i < student_count; i++) {
-        if (students[i].id == id) {
-            return i;  // Return index if student is found
+// Function to find a student by ID within its shard. Racing readers may see a stale index,
+// so every candidate is checked against the table and probing always ends
+int find_student(Shard *shard, int id) {
+    unsigned mask = (1u << student_slot_bits) - 1;
+    unsigned slot = student_slot(id);
+    for (unsigned probes = 0; probes <= mask; probes++, slot = (slot + 1) & mask) {
+        int index = shard->student_slots[slot];
+        if (index == -1) {
+            break;
+        }
+        if (index < shard->student_count && shard->students[index].id == id) {
+            return index;  // Return index if student is found
         }
     }
     return -1;  // Return -1 if student is not found
 }
 
+// Function to record the position of a student in the index of its shard
+void student_index_insert(Shard *shard, int index) {
+    unsigned mask = (1u << student_slot_bits) - 1;
+    unsigned slot = student_slot(shard->students[index].id);
+    while (shard->student_slots[slot] != -1) {
+        slot = (slot + 1) & mask;
+    }
+    shard->student_slots[slot] = index;
+}
+
+// Function to find the index slot holding a position of a student
+unsigned student_index_slot(Shard *shard, int id, int index) {
+    unsigned mask = (1u << student_slot_bits) - 1;
+    unsigned slot = student_slot(id);
+    while (shard->student_slots[slot] != index) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Function to update the index after a student moved within the students of its shard
+void student_index_move(Shard *shard, int from, int to) {
+    shard->student_slots[student_index_slot(shard, shard->students[to].id, from)] = to;
+}
+
+// Function to remove a student from the index of its shard before it leaves the table. The
+// entries after it in the probe run shift back into the hole unless that would put them before
+// their first slot, so lookups need no tombstones
+void student_index_remove(Shard *shard, int id, int index) {
+    unsigned mask = (1u << student_slot_bits) - 1;
+    unsigned hole = student_index_slot(shard, id, index);
+    for (unsigned slot = (hole + 1) & mask; shard->student_slots[slot] != -1; slot = (slot + 1) & mask) {
+        unsigned home = student_slot(shard->students[shard->student_slots[slot]].id);
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            shard->student_slots[hole] = shard->student_slots[slot];
+            hole = slot;
+        }
+    }
+    shard->student_slots[hole] = -1;
+}
+
 // Function to find an exam by ID
 int find_exam(int id) {
     for (int i = 0; i < exam_count; i++) {
@@ -61,94 +498,673 @@ int find_exam(int id) {
     return -1;  // Return -1 if exam is not found
 }
 
-// Function to add a new student
-void add_student(int id, char *name, char *faculty) {
-    if (find_student(id) != -1) {
-        fprintf(output, "Student: %d already exists\n", id);
+// Function to find an exam without taking the exam lock
+int lookup_exam(int id) {
+    int index;
+    for (int attempts = 0;; attempts++) {
+        unsigned sequence = read_begin(&exam_lock, attempts);
+        index = find_exam(id);
+        if (!read_retry(&exam_lock, sequence, attempts)) {
+            return index;
+        }
+    }
+}
+
+// Function to change the number of grades of one value in a Fenwick tree
+void fenwick_add(int *tree, int grade, int delta) {
+    for (int i = grade + 1; i <= MAX_GRADE + 1; i += i & -i) {
+        tree[i] += delta;
+    }
+}
+
+// Function to count the grades of at most the given value in a Fenwick tree
+int fenwick_count(const int *tree, int grade) {
+    int count = 0;
+    for (int i = grade + 1; i > 0; i -= i & -i) {
+        count += tree[i];
+    }
+    return count;
+}
+
+// Function to find the k-th lowest grade in a Fenwick tree, k counts from 1
+int fenwick_find(const int *tree, int k) {
+    int position = 0;  // Largest index whose prefix holds fewer than k grades
+    int step = 1;
+    while (step * 2 <= MAX_GRADE + 1) {
+        step *= 2;
+    }
+    for (; step > 0; step /= 2) {
+        if (position + step <= MAX_GRADE + 1 && tree[position + step] < k) {
+            position += step;
+            k -= tree[position];
+        }
+    }
+    return position;  // Index position + 1 holds grade position
+}
+
+// Function to account a grade in the aggregates of its exam
+void stats_add(Shard *shard, const Grade *grade) {
+    ExamStats *stats = &shard->exam_stats[grade->exam_index];
+    stats->count++;
+    stats->sum += grade->grade;
+    stats->passed += grade->grade >= PASS_GRADE;
+    fenwick_add(stats->tree, grade->grade, 1);
+}
+
+// Function to remove a grade from the aggregates of its exam
+void stats_remove(Shard *shard, const Grade *grade) {
+    ExamStats *stats = &shard->exam_stats[grade->exam_index];
+    stats->count--;
+    stats->sum -= grade->grade;
+    stats->passed -= grade->grade >= PASS_GRADE;
+    fenwick_add(stats->tree, grade->grade, -1);
+}
+
+// Function to find the index of a faculty in faculty_names, -1 if it is not a faculty
+int find_faculty(const char *name) {
+    for (int i = 0; i < FACULTY_COUNT; i++) {
+        if (strcmp(faculty_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function to get the indexed list of a grade among the lists of its kind
+int list_slot(int list, const Grade *grade) {
+    if (list == LIST_ROSTER) {
+        return grade->exam_index;
+    }
+    int key = list == LIST_EXAM ? grade->exam_index : grade->faculty_index;
+    return key * (MAX_GRADE + 1) + grade->grade;
+}
+
+// Function to get the head of one of the lists a grade belongs to
+int *list_head(Shard *shard, int list, const Grade *grade) {
+    if (list < INDEXED_LIST_COUNT) {
+        return &list_heads(shard, list)[list_slot(list, grade)];
+    }
+    return &shard->students[find_student(shard, grade->student_id)].first_grade;
+}
+
+// Function to check whether a grade comes before another in the lists: by student ID, exam ID
+// and then position in the grade table, which deletions keep in insertion order
+int grade_before(const Shard *shard, int index, int other) {
+    const Grade *grade = &shard->grades[index], *next = &shard->grades[other];
+    if (grade->student_id != next->student_id) {
+        return grade->student_id < next->student_id;
+    }
+    if (grade->exam_id != next->exam_id) {
+        return grade->exam_id < next->exam_id;
+    }
+    return index < other;
+}
+
+// Function to get the treap priority of a grade, a hash of its student and exam ID
+unsigned grade_priority(const Grade *grade) {
+    unsigned hash = (unsigned)grade->student_id * 2654435761u ^ (unsigned)grade->exam_id * 2246822519u;
+    hash ^= hash >> 15;
+    hash *= 2246822519u;
+    return hash ^ hash >> 13;
+}
+
+// Function to get the pointer to a grade in its tree: the child link of its parent or the root
+int *tree_link(Shard *shard, int list, const Grade *grade, int index) {
+    int parent = grade->nodes[list].parent;
+    if (parent == -1) {
+        return &shard->list_roots[list][list_slot(list, grade)];
+    }
+    GradeNode *above = &shard->grades[parent].nodes[list];
+    return above->left == index ? &above->left : &above->right;
+}
+
+// Function to rotate a grade above its parent in a tree, keeping the order of the grades
+void tree_rotate_up(Shard *shard, int list, int index) {
+    Grade *grades = shard->grades;
+    GradeNode *node = &grades[index].nodes[list];
+    int parent = node->parent;
+    GradeNode *above = &grades[parent].nodes[list];
+    *tree_link(shard, list, &grades[parent], parent) = index;
+    node->parent = above->parent;
+    int *inner = above->left == index ? &node->right : &node->left;  // Subtree changing sides
+    *(above->left == index ? &above->left : &above->right) = *inner;
+    if (*inner != -1) {
+        grades[*inner].nodes[list].parent = parent;
+    }
+    *inner = parent;
+    above->parent = index;
+}
+
+// Function to add a grade to the tree of its list, returns the grade it follows or -1 if it comes first
+int tree_insert(Shard *shard, int list, int index) {
+    Grade *grades = shard->grades;
+    Grade *grade = &grades[index];
+    int *link = &shard->list_roots[list][list_slot(list, grade)];
+    int parent = -1, prev = -1;
+    while (*link != -1) {
+        parent = *link;
+        if (grade_before(shard, index, parent)) {
+            link = &grades[parent].nodes[list].left;
+        } else {
+            prev = parent;
+            link = &grades[parent].nodes[list].right;
+        }
+    }
+    *link = index;
+    grade->nodes[list] = (GradeNode){-1, -1, parent};
+    unsigned priority = grade_priority(grade);
+    while (grade->nodes[list].parent != -1 && grade_priority(&grades[grade->nodes[list].parent]) < priority) {
+        tree_rotate_up(shard, list, index);
+    }
+    return prev;
+}
+
+// Function to take a grade out of the tree of its list by rotating it down to a leaf
+void tree_remove(Shard *shard, int list, int index) {
+    Grade *grades = shard->grades;
+    GradeNode *node = &grades[index].nodes[list];
+    while (node->left != -1 || node->right != -1) {
+        int child = node->left == -1    ? node->right
+                    : node->right == -1 ? node->left
+                    : grade_priority(&grades[node->left]) > grade_priority(&grades[node->right]) ? node->left
+                                                                                                 : node->right;
+        tree_rotate_up(shard, list, child);
+    }
+    *tree_link(shard, list, &grades[index], index) = -1;
+}
+
+// Function to link a grade into one of its lists in order. Leaderboards and rosters find its place
+// in their tree, the short transcript is walked from the start
+void list_insert(Shard *shard, int list, int index) {
+    Grade *grade = &shard->grades[index];
+    int *head = list_head(shard, list, grade);
+    int prev = -1;
+    if (list < INDEXED_LIST_COUNT) {
+        prev = tree_insert(shard, list, index);
+    } else {
+        for (int next = *head; next != -1 && !grade_before(shard, index, next);
+             next = shard->grades[next].links[list].next) {
+            prev = next;
+        }
+    }
+    int next = prev == -1 ? *head : shard->grades[prev].links[list].next;
+    grade->links[list].prev = prev;
+    grade->links[list].next = next;
+    *(prev == -1 ? head : &shard->grades[prev].links[list].next) = index;
+    if (next != -1) {
+        shard->grades[next].links[list].prev = index;
+    }
+}
+
+// Function to unlink a grade from one of its lists
+void list_remove(Shard *shard, int list, int index) {
+    Grade *grade = &shard->grades[index];
+    if (list < INDEXED_LIST_COUNT) {
+        tree_remove(shard, list, index);
+    }
+    GradeLink link = grade->links[list];
+    *(link.prev == -1 ? list_head(shard, list, grade) : &shard->grades[link.prev].links[list].next) = link.next;
+    if (link.next != -1) {
+        shard->grades[link.next].links[list].prev = link.prev;
+    }
+}
+
+// Function to link a grade into its first lists
+void grade_link(Shard *shard, int index, int lists) {
+    for (int list = 0; list < lists; list++) {
+        list_insert(shard, list, index);
+    }
+}
+
+// Function to unlink a grade from its first lists
+void grade_unlink(Shard *shard, int index, int lists) {
+    for (int list = 0; list < lists; list++) {
+        list_remove(shard, list, index);
+    }
+}
+
+// Function to move a grade to another slot of the table, keeping its lists and trees intact
+void grade_move(Shard *shard, int from, int to) {
+    Grade *grade = &shard->grades[to];
+    *grade = shard->grades[from];
+    for (int list = 0; list < LIST_COUNT; list++) {
+        GradeLink link = grade->links[list];
+        *(link.prev == -1 ? list_head(shard, list, grade) : &shard->grades[link.prev].links[list].next) = to;
+        if (link.next != -1) {
+            shard->grades[link.next].links[list].prev = to;
+        }
+        if (list < INDEXED_LIST_COUNT) {
+            GradeNode node = grade->nodes[list];
+            *tree_link(shard, list, grade, from) = to;
+            if (node.left != -1) {
+                shard->grades[node.left].nodes[list].parent = to;
+            }
+            if (node.right != -1) {
+                shard->grades[node.right].nodes[list].parent = to;
+            }
+        }
+    }
+}
+
+// Function to allocate memory that the tables cannot do without, exits when memory runs out
+void *checked_realloc(void *pointer, size_t size) {
+    void *result = realloc(pointer, size);
+    if (!result) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    return result;
+}
+
+// Function to map a student ID to a bitmap value, keeping negative IDs ordered before the others
+uint32_t bitmap_value(int id) {
+    return (uint32_t)id ^ 0x80000000u;
+}
+
+// Function to map a bitmap value back to a student ID
+int bitmap_id(uint32_t value) {
+    return (int)(value ^ 0x80000000u);
+}
+
+// Function to find the container of a key, returns its position or where it would be inserted
+int bitmap_search(const Bitmap *bitmap, uint16_t key, int *found) {
+    int low = 0, high = bitmap->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (bitmap->containers[middle].key < key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    *found = low < bitmap->count && bitmap->containers[low].key == key;
+    return low;
+}
+
+// Function to find a value in a sorted array container, returns its position or where it would be inserted
+int container_search(const Container *container, uint16_t low_bits) {
+    int low = 0, high = container->cardinality;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (container->array[middle] < low_bits) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Function to release the memory of a container
+void container_free(Container *container) {
+    free(container->array);
+    free(container->words);
+    container->array = NULL;
+    container->words = NULL;
+}
+
+// Function to build a container from a bitset, picking the smaller form, takes ownership of words
+void container_from_words(Container *container, uint16_t key, uint64_t *words) {
+    int cardinality = 0;
+    for (int i = 0; i < CONTAINER_WORDS; i++) {
+        cardinality += __builtin_popcountll(words[i]);
+    }
+    container->key = key;
+    container->cardinality = cardinality;
+    container->array = NULL;
+    container->words = words;
+    if (cardinality > ARRAY_CONTAINER_LIMIT) {
+        return;
+    }
+    container->array = checked_realloc(NULL, (cardinality ? cardinality : 1) * sizeof(uint16_t));
+    int position = 0;
+    for (int i = 0; i < CONTAINER_WORDS; i++) {
+        for (uint64_t word = words[i]; word; word &= word - 1) {
+            container->array[position++] = (uint16_t)(i * 64 + __builtin_ctzll(word));
+        }
+    }
+    free(words);
+    container->words = NULL;
+}
+
+// Function to get the bitset of a container, a copy the caller frees
+uint64_t *container_words(const Container *container) {
+    uint64_t *words = checked_realloc(NULL, CONTAINER_WORDS * sizeof(uint64_t));
+    if (container->words) {
+        memcpy(words, container->words, CONTAINER_WORDS * sizeof(uint64_t));
+        return words;
+    }
+    memset(words, 0, CONTAINER_WORDS * sizeof(uint64_t));
+    for (int i = 0; i < container->cardinality; i++) {
+        words[container->array[i] / 64] |= 1ull << (container->array[i] % 64);
+    }
+    return words;
+}
+
+// Function to add a value to a bitmap
+void bitmap_add(Bitmap *bitmap, uint32_t value) {
+    int found;
+    int position = bitmap_search(bitmap, (uint16_t)(value >> 16), &found);
+    if (!found) {
+        if (bitmap->count == bitmap->capacity) {
+            bitmap->capacity = bitmap->capacity ? bitmap->capacity * 2 : 4;
+            bitmap->containers = checked_realloc(bitmap->containers, bitmap->capacity * sizeof(Container));
+        }
+        memmove(&bitmap->containers[position + 1], &bitmap->containers[position],
+                (bitmap->count - position) * sizeof(Container));
+        bitmap->containers[position] = (Container){(uint16_t)(value >> 16), 0, NULL, NULL};
+        bitmap->count++;
+    }
+    Container *container = &bitmap->containers[position];
+    uint16_t low_bits = (uint16_t)value;
+    if (container->words) {
+        uint64_t bit = 1ull << (low_bits % 64);
+        container->cardinality += !(container->words[low_bits / 64] & bit);
+        container->words[low_bits / 64] |= bit;
+        return;
+    }
+    int index = container_search(container, low_bits);
+    if (index < container->cardinality && container->array[index] == low_bits) {
+        return;  // Already present
+    }
+    if (container->cardinality == ARRAY_CONTAINER_LIMIT) {
+        uint64_t *words = container_words(container);  // Too dense for an array
+        words[low_bits / 64] |= 1ull << (low_bits % 64);
+        container_free(container);
+        container->words = words;
+        container->cardinality++;
+        return;
+    }
+    container->array = checked_realloc(container->array, (container->cardinality + 1) * sizeof(uint16_t));
+    memmove(&container->array[index + 1], &container->array[index],
+            (container->cardinality - index) * sizeof(uint16_t));
+    container->array[index] = low_bits;
+    container->cardinality++;
+}
+
+// Function to remove a value from a bitmap
+void bitmap_remove(Bitmap *bitmap, uint32_t value) {
+    int found;
+    int position = bitmap_search(bitmap, (uint16_t)(value >> 16), &found);
+    if (!found) {
+        return;
+    }
+    Container *container = &bitmap->containers[position];
+    uint16_t low_bits = (uint16_t)value;
+    if (container->words) {
+        uint64_t bit = 1ull << (low_bits % 64);
+        if (!(container->words[low_bits / 64] & bit)) {
+            return;
+        }
+        container->words[low_bits / 64] &= ~bit;
+        if (--container->cardinality == ARRAY_CONTAINER_LIMIT) {
+            uint64_t *words = container->words;  // Sparse again, store it as an array
+            container->words = NULL;
+            container_from_words(container, container->key, words);
+        }
+        return;
+    }
+    int index = container_search(container, low_bits);
+    if (index == container->cardinality || container->array[index] != low_bits) {
+        return;
+    }
+    memmove(&container->array[index], &container->array[index + 1],
+            (container->cardinality - index - 1) * sizeof(uint16_t));
+    if (--container->cardinality == 0) {
+        container_free(container);
+        memmove(&bitmap->containers[position], &bitmap->containers[position + 1],
+                (bitmap->count - position - 1) * sizeof(Container));
+        bitmap->count--;
+    }
+}
+
+// Function to release the memory of a bitmap
+void bitmap_free(Bitmap *bitmap) {
+    for (int i = 0; i < bitmap->count; i++) {
+        container_free(&bitmap->containers[i]);
+    }
+    free(bitmap->containers);
+    *bitmap = (Bitmap){NULL, 0, 0};
+}
+
+enum { SET_AND, SET_OR, SET_ANDNOT };  // Set operations of QUERY
+
+// Function to combine two containers of the same key into result, leaves it empty if nothing remains
+void container_combine(const Container *a, const Container *b, int operation, Container *result) {
+    if (a->array && b->array) {
+        // Merge the sorted arrays, an OR of two sparse containers may outgrow the array form
+        uint16_t *merged = checked_realloc(NULL, (a->cardinality + b->cardinality + 1) * sizeof(uint16_t));
+        int i = 0, j = 0, count = 0;
+        while (i < a->cardinality || j < b->cardinality) {
+            int in_a = i < a->cardinality && (j == b->cardinality || a->array[i] <= b->array[j]);
+            int in_b = j < b->cardinality && (i == a->cardinality || b->array[j] <= a->array[i]);
+            uint16_t low_bits = in_a ? a->array[i] : b->array[j];
+            if (operation == SET_OR || (operation == SET_AND && in_a && in_b) ||
+                (operation == SET_ANDNOT && in_a && !in_b)) {
+                merged[count++] = low_bits;
+            }
+            i += in_a;
+            j += in_b;
+        }
+        *result = (Container){a->key, count, merged, NULL};
+        if (count > ARRAY_CONTAINER_LIMIT) {
+            uint64_t *words = container_words(result);
+            free(merged);
+            container_from_words(result, a->key, words);
+        }
+        return;
+    }
+    // At least one side is dense: combine word by word, the loops vectorize
+    uint64_t *words = container_words(a);
+    uint64_t *other = container_words(b);
+    if (operation == SET_AND) {
+        for (int i = 0; i < CONTAINER_WORDS; i++) {
+            words[i] &= other[i];
+        }
+    } else if (operation == SET_OR) {
+        for (int i = 0; i < CONTAINER_WORDS; i++) {
+            words[i] |= other[i];
+        }
+    } else {
+        for (int i = 0; i < CONTAINER_WORDS; i++) {
+            words[i] &= ~other[i];
+        }
+    }
+    free(other);
+    container_from_words(result, a->key, words);
+}
+
+// Function to copy a container
+void container_copy(const Container *source, Container *copy) {
+    *copy = *source;
+    if (source->array) {
+        copy->array = checked_realloc(NULL, (source->cardinality ? source->cardinality : 1) * sizeof(uint16_t));
+        memcpy(copy->array, source->array, source->cardinality * sizeof(uint16_t));
+    } else {
+        copy->words = container_words(source);
+    }
+}
+
+// Function to combine two bitmaps into a new one, container by container
+void bitmap_combine(const Bitmap *a, const Bitmap *b, int operation, Bitmap *result) {
+    *result = (Bitmap){NULL, 0, 0};
+    result->capacity = a->count + b->count + 1;
+    result->containers = checked_realloc(NULL, result->capacity * sizeof(Container));
+    int i = 0, j = 0;
+    while (i < a->count || j < b->count) {
+        int in_a = i < a->count && (j == b->count || a->containers[i].key <= b->containers[j].key);
+        int in_b = j < b->count && (i == a->count || b->containers[j].key <= a->containers[i].key);
+        Container *container = &result->containers[result->count];
+        if (in_a && in_b) {
+            container_combine(&a->containers[i], &b->containers[j], operation, container);
+        } else if (in_a && operation != SET_AND) {
+            container_copy(&a->containers[i], container);
+        } else if (in_b && operation == SET_OR) {
+            container_copy(&b->containers[j], container);
+        } else {
+            container->cardinality = 0;  // Key of one side only, absent from the result
+            container->array = NULL;
+            container->words = NULL;
+        }
+        if (container->cardinality > 0) {
+            result->count++;
+        } else {
+            container_free(container);
+        }
+        i += in_a;
+        j += in_b;
+    }
+}
+
+// Function to find the first grade of a student in an exam by walking the student's transcript,
+// -1 if there is none. The walk is bounded, so a racing reader cannot loop on half-updated links
+int find_grade(Shard *shard, int student_index, int exam_id) {
+    int next = shard->students[student_index].first_grade;
+    for (int steps = 0; next != -1 && steps < MAX_GRADES; steps++) {
+        const Grade *grade = &shard->grades[next];
+        if (grade->exam_id >= exam_id) {
+            return grade->exam_id == exam_id ? next : -1;  // The transcript is sorted by exam ID
+        }
+        next = grade->links[LIST_TRANSCRIPT].next;
+    }
+    return -1;
+}
+
+// Function to add a new student, the caller holds the student's shard lock
+void add_student(int id, const char *name, const char *faculty) {
+    Shard *shard = shard_of(id);
+    if (find_student(shard, id) != -1) {
+        report_error("Student: %d already exists\n", id);
         return;  // Do not add if student ID already exists
     }
     if (strlen(name) >= MAX_NAME_LENGTH || strlen(faculty) >= MAX_FACULTY_LENGTH) {
-        fprintf(output, "Invalid name or faculty length\n");
+        report_error("Invalid name or faculty length\n");
         return;  // Check for valid length of name and faculty
     }
     // Validate faculty name
-    if (strcmp(faculty, "SoftwareEngineering") != 0 &&
-        strcmp(faculty, "ComputerScience") != 0 &&
-        strcmp(faculty, "DataScience") != 0 &&
-        strcmp(faculty, "CyberSecurity") != 0 &&
-        strcmp(faculty, "InformationTechnology") != 0 &&
-        strcmp(faculty, "ProgrammingLanguagesAndCompilers") != 0) {
-        fprintf(output, "Invalid faculty\n");
+    if (find_faculty(faculty) == -1) {
+        report_error("Invalid faculty\n");
         return;  // Check for valid faculty name
     }
     // Ensure name contains only alphabetic characters
     for (int i = 0; name[i] != '\0'; i++) {
         if (!isalpha(name[i])) {
-            fprintf(output, "Invalid name\n");
+            report_error("Invalid name\n");
             return;  // If name contains non-alphabetical characters, reject it
         }
     }
-    // Add the new student
-    students[student_count].id = id;
-    strcpy(students[student_count].name, name);
-    strcpy(students[student_count].faculty, faculty);
-    student_count++;
+    if (atomic_fetch_add(&student_count, 1) >= MAX_STUDENTS) {
+        atomic_fetch_sub(&student_count, 1);
+        report_error("Too many students\n");
+        return;  // A long-running server must not write past the table
+    }
+    // Add the new student, keeping the shard sorted by order when queued commands overtook each other
+    long long order = reserved_order >= 0 ? reserved_order : atomic_fetch_add(&student_order, 1);
+    int position = shard->student_count;
+    while (position > 0 && shard->students[position - 1].order > order) {
+        shard->students[position] = shard->students[position - 1];
+        student_index_move(shard, position - 1, position);
+        position--;
+    }
+    Student *student = &shard->students[position];
+    student->id = id;
+    strcpy(student->name, name);
+    strcpy(student->faculty, faculty);
+    student->order = order;
+    student->graded = 0;
+    student->weighted_sum = 0;
+    student->weight_sum = 0;
+    student->first_grade = -1;
+    shard->student_count++;
+    student_index_insert(shard, position);
+    bitmap_add(&shard->faculty_members[find_faculty(faculty)], bitmap_value(id));
+    MOODLE_PROBE3(student_added, id, shard->student_count, (int)student_count);
     fprintf(output, "Student: %d added\n", id);
 }
 
-// Function to add a new exam
-void add_exam(int id, char *type, char *info) {
+// Function to add a new exam, the caller holds the exam lock
+void add_exam(int id, const char *type, const char *info) {
     if (find_exam(id) != -1) {
-        fprintf(output, "Exam: %d already exists\n", id);
+        report_error("Exam: %d already exists\n", id);
         return;  // Do not add if exam ID already exists
     }
     if (strlen(type) >= MAX_TYPE_LENGTH || strlen(info) >= MAX_NAME_LENGTH) {
-        fprintf(output, "Invalid type or info length\n");
+        report_error("Invalid type or info length\n");
         return;  // Check for valid length of type and info
     }
+    if (exam_count == MAX_EXAMS) {
+        report_error("Too many exams\n");
+        return;  // A long-running server must not write past the table
+    }
     // Add the new exam
     exams[exam_count].id = id;
     strcpy(exams[exam_count].type, type);
     strcpy(exams[exam_count].info, info);
+    exams[exam_count].weight = 1;
     exam_count++;
     fprintf(output, "Exam: %d added\n", id);
 }
 
-// Function to add a grade for a student in an exam
+// Function to add a grade for a student in an exam, the caller holds the student's shard lock
 void add_grade(int exam_id, int student_id, int grade_value) {
+    Shard *shard = shard_of(student_id);
     if (grade_value < 0 || grade_value > 100) {
-        fprintf(output, "Invalid grade\n");
+        report_error("Invalid grade\n");
         return;  // Grade value must be between 0 and 100
     }
-    if (find_student(student_id) == -1) {
-        fprintf(output, "Student not found\n");
+    int student_index = find_student(shard, student_id);
+    if (student_index == -1) {
+        report_error("Student not found\n");
         return;  // Ensure student exists
     }
-    if (find_exam(exam_id) == -1) {
-        fprintf(output, "Exam not found\n");
+    int exam_index = lookup_exam(exam_id);
+    if (exam_index == -1) {
+        report_error("Exam not found\n");
         return;  // Ensure exam exists
     }
+    if (atomic_fetch_add(&grade_count, 1) >= MAX_GRADES) {
+        atomic_fetch_sub(&grade_count, 1);
+        report_error("Too many grades\n");
+        return;  // A long-running server must not write past the table
+    }
     // Add the new grade
-    grades[grade_count].exam_id = exam_id;
-    grades[grade_count].student_id = student_id;
-    grades[grade_count].grade = grade_value;
-    grade_count++;
+    Grade *grade = &shard->grades[shard->grade_count];
+    grade->exam_id = exam_id;
+    grade->student_id = student_id;
+    grade->grade = grade_value;
+    grade->exam_index = exam_index;
+    grade->faculty_index = find_faculty(shard->students[student_index].faculty);
+    stats_add(shard, grade);
+    grade_link(shard, shard->grade_count, LIST_COUNT);
+    shard->grade_count++;
+    Student *student = &shard->students[student_index];
+    student->graded++;
+    student->weighted_sum += (long long)exams[exam_index].weight * grade_value;
+    student->weight_sum += exams[exam_index].weight;
+    if (grade_value >= PASS_GRADE) {
+        bitmap_add(&shard->passed[exam_index], bitmap_value(student_id));
+    }
+    MOODLE_PROBE5(grade_added, exam_id, student_id, grade_value, shard->grade_count, (int)grade_count);
     fprintf(output, "Grade %d added for the student: %d\n", grade_value, student_id);
 }
 
-// Function to update exam information
-void update_exam(int id, char *new_type, char *new_info) {
+// Function to update exam information, the caller holds the exam lock
+void update_exam(int id, const char *new_type, const char *new_info) {
     int index = find_exam(id);
     if (index == -1) {
-        fprintf(output, "Exam not found\n");
+        report_error("Exam not found\n");
         return;  // Ensure exam exists
     }
 
     // Validate the new type of exam before updating
     if (strcmp(new_type, "WRITTEN") != 0 && strcmp(new_type, "DIGITAL") != 0) {
-        fprintf(output, "Invalid exam type\n");
+        report_error("Invalid exam type\n");
         return;  // Type must be either WRITTEN or DIGITAL
     }
+    if (strlen(new_info) >= MAX_NAME_LENGTH) {
+        report_error("Invalid type or info length\n");
+        return;  // The parser accepts longer fields than the exam table holds
+    }
 
     // Update the exam type and information
     strcpy(exams[index].type, new_type);
@@ -156,171 +1172,2874 @@ void update_exam(int id, char *new_type, char *new_info) {
     fprintf(output, "Exam: %d updated\n", id);
 }
 
-// Function to update a grade
-void update_grade(int exam_id, int student_id, int new_grade) {
-    if (new_grade < 0 || new_grade > 100) {
-        fprintf(output, "Invalid grade\n");
-        return;  // Grade value must be between 0 and 100
+// Function to change the weight of an exam, the caller holds every shard lock and the exam lock
+void set_exam_weight(int id, int weight) {
+    int index = find_exam(id);
+    if (index == -1) {
+        report_error("Exam not found\n");
+        return;  // Ensure exam exists
     }
-    for (int i = 0; i < grade_count; i++) {
-        if (grades[i].exam_id == exam_id && grades[i].student_id == student_id) {
-            grades[i].grade = new_grade;
-            fprintf(output, "Grade %d updated for the student: %d\n", new_grade, student_id);
-            return;  // Update the grade if found
+    if (weight <= 0) {
+        report_error("Invalid weight\n");
+        return;  // Averages divide by the sum of the weights
+    }
+    // Rebase the averages of the students graded in this exam, found through its leaderboards
+    int delta = weight - exams[index].weight;
+    for (int i = 0; i < shard_count; i++) {
+        Shard *shard = &shards[i];
+        for (int value = 0; value <= MAX_GRADE; value++) {
+            int next = shard->leaderboards[LIST_EXAM][index * (MAX_GRADE + 1) + value];
+            for (; next != -1; next = shard->grades[next].links[LIST_EXAM].next) {
+                Student *student = &shard->students[find_student(shard, shard->grades[next].student_id)];
+                student->weighted_sum += (long long)delta * value;
+                student->weight_sum += delta;
+            }
         }
     }
-    fprintf(output, "Student not found\n");
+    exams[index].weight = weight;
+    fprintf(output, "Exam: %d weight updated\n", id);
 }
 
-// Function to delete a student
-void delete_student(int id) {
-    int index = find_student(id);
-    if (index == -1) {
-        fprintf(output, "Student not found\n");
-        return;  // Ensure student exists
+// Function to curve every grade of an exam to scale * grade + shift, rounded and clamped to 0..MAX_GRADE.
+// The caller holds every shard lock, so no reader sees the exam half curved
+void curve_exam(int exam_id, double scale, double shift) {
+    int exam_index = lookup_exam(exam_id);
+    if (exam_index == -1) {
+        report_error("Exam not found\n");
+        return;  // Ensure exam exists
     }
-    // Remove all grades associated with the student
-    for (int i = 0; i < grade_count; i++) {
-        if (grades[i].student_id == id) {
-            for (int j = i; j < grade_count - 1; j++) {
-                grades[j] = grades[j + 1];  // Shift grades left
+    int curve[MAX_GRADE + 1];  // New value of every grade value, so each grade costs one lookup
+    for (int value = 0; value <= MAX_GRADE; value++) {
+        double curved = scale * value + shift;
+        if (!(curved >= 0)) {
+            curved = 0;  // Also catches NaN
+        } else if (curved > MAX_GRADE) {
+            curved = MAX_GRADE;
+        }
+        curve[value] = (int)(curved + 0.5);
+    }
+    int curved_count = 0;
+    for (int i = 0; i < shard_count; i++) {
+        Shard *shard = &shards[i];
+        int weight = exams[exam_index].weight;  // Stable while every shard is locked
+        Bitmap *passed = &shard->passed[exam_index];
+        // Walk the exam's roster and move every changed grade to its new leaderboards. The roster
+        // holds the grades of a student next to each other, so whether the student still passes
+        // is known after their last one
+        int g = shard->rosters[exam_index];
+        while (g != -1) {
+            int student_id = shard->grades[g].student_id;
+            Student *student = &shard->students[find_student(shard, student_id)];
+            int passed_before = 0, passed_after = 0;
+            for (; g != -1 && shard->grades[g].student_id == student_id; g = shard->grades[g].links[LIST_ROSTER].next) {
+                Grade *grade = &shard->grades[g];
+                curved_count++;
+                int old_grade = grade->grade;
+                int new_grade = curve[old_grade];
+                passed_before |= old_grade >= PASS_GRADE;
+                passed_after |= new_grade >= PASS_GRADE;
+                if (new_grade != old_grade) {
+                    stats_remove(shard, grade);
+                    grade_unlink(shard, g, VALUE_LIST_COUNT);
+                    student->weighted_sum += (long long)weight * (new_grade - old_grade);
+                    grade->grade = new_grade;
+                    stats_add(shard, grade);
+                    grade_link(shard, g, VALUE_LIST_COUNT);
+                }
+            }
+            if (passed_after && !passed_before) {
+                bitmap_add(passed, bitmap_value(student_id));
+            } else if (passed_before && !passed_after) {
+                bitmap_remove(passed, bitmap_value(student_id));
             }
-            grade_count--;
-            i--;  // Recheck the current position after shifting
         }
     }
-    // Remove the student from the array
-    for (int i = index; i < student_count - 1; i++) {
-        students[i] = students[i + 1];  // Shift students left
+    fprintf(output, "Exam: %d curved, Grades: %d\n", exam_id, curved_count);
+}
+
+// Function to check whether a student has a passing grade in an exam
+int student_passed(Shard *shard, int student_index, int exam_id) {
+    int next = find_grade(shard, student_index, exam_id);
+    while (next != -1 && shard->grades[next].exam_id == exam_id) {
+        if (shard->grades[next].grade >= PASS_GRADE) {
+            return 1;
+        }
+        next = shard->grades[next].links[LIST_TRANSCRIPT].next;
+    }
+    return 0;
+}
+
+// Function to update a grade, the caller holds the student's shard lock
+void update_grade(int exam_id, int student_id, int new_grade) {
+    Shard *shard = shard_of(student_id);
+    if (new_grade < 0 || new_grade > 100) {
+        report_error("Invalid grade\n");
+        return;  // Grade value must be between 0 and 100
+    }
+    int student_index = find_student(shard, student_id);
+    int i = student_index == -1 ? -1 : find_grade(shard, student_index, exam_id);
+    if (i == -1) {
+        report_error("Student not found\n");
+        return;
+    }
+    Grade *grade = &shard->grades[i];
+    stats_remove(shard, grade);
+    grade_unlink(shard, i, VALUE_LIST_COUNT);  // Roster and transcript do not depend on the value
+    shard->students[student_index].weighted_sum +=
+        (long long)exams[grade->exam_index].weight * (new_grade - grade->grade);
+    int old_grade = grade->grade;
+    grade->grade = new_grade;
+    stats_add(shard, grade);
+    grade_link(shard, i, VALUE_LIST_COUNT);
+    Bitmap *passed = &shard->passed[grade->exam_index];
+    if (new_grade >= PASS_GRADE) {
+        bitmap_add(passed, bitmap_value(student_id));
+    } else if (old_grade >= PASS_GRADE && !student_passed(shard, student_index, exam_id)) {
+        bitmap_remove(passed, bitmap_value(student_id));
+    }
+    MOODLE_PROBE5(grade_updated, exam_id, student_id, old_grade, new_grade, shard->grade_count);
+    fprintf(output, "Grade %d updated for the student: %d\n", new_grade, student_id);
+}
+
+// Function to delete a student, the caller holds the student's shard lock
+void delete_student(int id) {
+    Shard *shard = shard_of(id);
+    int index = find_student(shard, id);
+    if (index == -1) {
+        report_error("Student not found\n");
+        return;  // Ensure student exists
+    }
+    // Remove all grades associated with the student, shifting the others left in one pass
+    int kept = 0;
+    for (int i = 0; i < shard->grade_count; i++) {
+        if (shard->grades[i].student_id == id) {
+            stats_remove(shard, &shard->grades[i]);
+            grade_unlink(shard, i, LIST_COUNT);
+            bitmap_remove(&shard->passed[shard->grades[i].exam_index], bitmap_value(id));
+            atomic_fetch_sub(&grade_count, 1);
+            continue;
+        }
+        if (kept != i) {
+            grade_move(shard, i, kept);
+        }
+        kept++;
+    }
+    int removed = shard->grade_count - kept;
+    shard->grade_count = kept;
+    bitmap_remove(&shard->faculty_members[find_faculty(shard->students[index].faculty)], bitmap_value(id));
+    // Remove the student from the array
+    student_index_remove(shard, id, index);
+    for (int i = index; i < shard->student_count - 1; i++) {
+        shard->students[i] = shard->students[i + 1];  // Shift students left
+        student_index_move(shard, i + 1, i);
     }
-    student_count--;
+    shard->student_count--;
+    atomic_fetch_sub(&student_count, 1);
+    MOODLE_PROBE4(student_deleted, id, removed, shard->student_count, shard->grade_count);
     fprintf(output, "Student: %d deleted\n", id);
 }
 
 // Function to search and display student information
 void search_student(int id) {
-    int index = find_student(id);
+    Shard *shard = shard_of(id);
+    Student found;  // Private copy, printed only after the read is known to be consistent
+    int index;
+    for (int attempts = 0;; attempts++) {
+        unsigned sequence = read_begin(&shard->lock, attempts);
+        index = find_student(shard, id);
+        if (index != -1) {
+            found = shard->students[index];
+        }
+        if (!read_retry(&shard->lock, sequence, attempts)) {
+            break;
+        }
+    }
+
     if (index == -1) {
-        fprintf(output, "Student not found\n");
+        report_error("Student not found\n");
         return;  // Ensure student exists
     }
-    fprintf(output, "ID: %d, Name: %s, Faculty: %s\n", students[index].id, students[index].name, students[index].faculty);
+    fprintf(output, "ID: %d, Name: %s, Faculty: %s\n", found.id, found.name, found.faculty);
 }
 
 // Function to search and display grade information
 void search_grade(int exam_id, int student_id) {
-    int student_index = find_student(student_id);
+    Shard *shard = shard_of(student_id);
+    Student student;  // Private copies, printed only after the read is known to be consistent
+    Exam exam;
+    int student_index, grade_index, exam_index;
+    int grade_value = 0;
+    for (int attempts = 0;; attempts++) {
+        // The shard is always locked before the exam table, also on the fallback path
+        unsigned shard_sequence = read_begin(&shard->lock, attempts);
+        unsigned exam_sequence = read_begin(&exam_lock, attempts);
+        exam_index = -1;
+        grade_index = -1;
+        student_index = find_student(shard, student_id);
+        if (student_index != -1) {
+            student = shard->students[student_index];
+            grade_index = find_grade(shard, student_index, exam_id);
+            if (grade_index != -1) {
+                grade_value = shard->grades[grade_index].grade;
+            }
+        }
+        if (grade_index != -1) {
+            exam_index = find_exam(exam_id);
+            if (exam_index != -1) {
+                exam = exams[exam_index];
+            }
+        }
+        int changed = read_retry(&exam_lock, exam_sequence, attempts);
+        changed |= read_retry(&shard->lock, shard_sequence, attempts);
+        if (!changed) {
+            break;
+        }
+    }
+
     if (student_index == -1) {
-        fprintf(output, "Student not found\n");
+        report_error("Student not found\n");
         return;  // Ensure student exists
     }
-    for (int i = 0; i < grade_count; i++) {
-        if (grades[i].exam_id == exam_id && grades[i].student_id == student_id) {
-            int exam_index = find_exam(exam_id);
-            if (exam_index == -1) {
-                fprintf(output, "Exam not found\n");
-                return;  // Ensure exam exists
-            }
-            fprintf(output, "Exam: %d, Student: %d, Name: %s, Grade: %d, Type: %s, Info: %s\n",
-                    exam_id, student_id, students[student_index].name, grades[i].grade,
-                    exams[exam_index].type, exams[exam_index].info);
-            return;  // Display grade information if found
+    if (grade_index == -1) {
+        report_error("Grade not found\n");
+        return;
+    }
+    if (exam_index == -1) {
+        report_error("Exam not found\n");
+        return;  // Ensure exam exists
+    }
+    fprintf(output, "Exam: %d, Student: %d, Name: %s, Grade: %d, Type: %s, Info: %s\n",
+            exam_id, student_id, student.name, grade_value, exam.type, exam.info);
+}
+
+// Structure to merge the students of every shard in insertion order
+typedef struct {
+    int next[MAX_SHARDS];  // Position of the next unlisted student of every shard
+    int heap[MAX_SHARDS];  // Shards with unlisted students, min-heap on the order of their next student
+    int size;  // Number of shards in the heap
+    int shard;  // Shard of the student returned last
+} StudentMerge;
+
+// Function to get the insertion order of the next unlisted student of a shard
+long long merge_order(const StudentMerge *merge, int shard) {
+    return shards[shard].students[merge->next[shard]].order;
+}
+
+// Function to move the shard at a heap position down until the heap is ordered again
+void merge_sift_down(StudentMerge *merge, int position) {
+    int shard = merge->heap[position];
+    for (;;) {
+        int child = 2 * position + 1;
+        if (child >= merge->size) {
+            break;
         }
+        if (child + 1 < merge->size &&
+            merge_order(merge, merge->heap[child + 1]) < merge_order(merge, merge->heap[child])) {
+            child++;  // The right child's next student came first
+        }
+        if (merge_order(merge, merge->heap[child]) >= merge_order(merge, shard)) {
+            break;
+        }
+        merge->heap[position] = merge->heap[child];
+        position = child;
+    }
+    merge->heap[position] = shard;
+}
+
+// Function to start merging the students of every shard, the caller holds every shard lock
+void merge_begin(StudentMerge *merge) {
+    merge->size = 0;
+    for (int i = 0; i < shard_count; i++) {
+        merge->next[i] = 0;
+        if (shards[i].student_count > 0) {
+            merge->heap[merge->size++] = i;
+        }
+    }
+    for (int position = merge->size / 2 - 1; position >= 0; position--) {
+        merge_sift_down(merge, position);
     }
-    fprintf(output, "Grade not found\n");
 }
 
-// Function to list all students
+// Function to get the next student in insertion order, NULL after the last one. Each student
+// costs O(log shards): the heap holds the shards by the order of their next student
+const Student *next_listed_student(StudentMerge *merge) {
+    if (merge->size == 0) {
+        return NULL;
+    }
+    int shard = merge->heap[0];
+    const Student *student = &shards[shard].students[merge->next[shard]++];
+    merge->shard = shard;
+    if (merge->next[shard] == shards[shard].student_count) {
+        merge->heap[0] = merge->heap[--merge->size];  // The shard is done, its place goes to the last one
+    }
+    merge_sift_down(merge, 0);
+    return student;
+}
+
+// Function to list all students in insertion order, the caller holds every shard lock
 void list_all_students() {
-    for (int i = 0; i < student_count; i++) {
-        fprintf(output, "ID: %d, Name: %s, Faculty: %s\n", students[i].id, students[i].name, students[i].faculty);
+    StudentMerge merge;
+    merge_begin(&merge);
+    const Student *student;
+    while ((student = next_listed_student(&merge))) {
+        fprintf(output, "ID: %d, Name: %s, Faculty: %s\n", student->id, student->name, student->faculty);
     }
 }
 
-int main() {
-    FILE *input = fopen("input.txt", "r");  // Open input file in reading mode
-    if (!input) {
-        perror("Failed to open input file");
-        return 1;  // Return 1 if input file cannot be opened
+// Function to display the weighted average of a student, kept up to date by every grade change
+void student_average(int id) {
+    Shard *shard = shard_of(id);
+    Student found;  // Private copy, printed only after the read is known to be consistent
+    int index;
+    for (int attempts = 0;; attempts++) {
+        unsigned sequence = read_begin(&shard->lock, attempts);
+        index = find_student(shard, id);
+        if (index != -1) {
+            found = shard->students[index];
+        }
+        if (!read_retry(&shard->lock, sequence, attempts)) {
+            break;
+        }
     }
 
-    output = fopen("output.txt", "w");  // Open output file in writing mode
-    if (!output) {
-        perror("Failed to open output file");
-        fclose(input);
-        return 1;  // Return 1 if output file cannot be opened
+    if (index == -1) {
+        report_error("Student not found\n");
+        return;  // Ensure student exists
     }
+    if (found.graded == 0) {
+        report_error("Grade not found\n");
+        return;
+    }
+    fprintf(output, "Student: %d, Name: %s, Grades: %d, Average: %.2f\n", found.id, found.name, found.graded,
+            (double)found.weighted_sum / found.weight_sum);
+}
 
-    char command[MAX_COMMAND_LENGTH];  // Command buffer
-    while (fgets(command, sizeof(command), input)) {
-        char cmd[30];  // Command name buffer
-        int id1, id2, grade;
-        char name[MAX_NAME_LENGTH], faculty[MAX_FACULTY_LENGTH];
-        char type[MAX_TYPE_LENGTH], info[MAX_NAME_LENGTH];
+// Function to list the weighted averages of all students in insertion order, the caller holds every shard lock
+void list_averages() {
+    StudentMerge merge;
+    merge_begin(&merge);
+    const Student *student;
+    while ((student = next_listed_student(&merge))) {
+        if (student->graded == 0) {
+            fprintf(output, "ID: %d, Name: %s, Grades: 0, Average: N/A\n", student->id, student->name);
+            continue;
+        }
+        fprintf(output, "ID: %d, Name: %s, Grades: %d, Average: %.2f\n", student->id, student->name,
+                student->graded, (double)student->weighted_sum / student->weight_sum);
+    }
+}
 
-        // Extract the command
-        sscanf(command, "%s", cmd);
+// Function to display the grade statistics of an exam, constant time whatever the class size
+void exam_stats(int exam_id) {
+    int exam_index = lookup_exam(exam_id);
+    if (exam_index == -1) {
+        report_error("Exam not found\n");
+        return;  // Ensure exam exists
+    }
+    ExamStats total = {0};  // Sum of the shard aggregates
+    for (int i = 0; i < shard_count; i++) {
+        ExamStats copy;  // Consistent copy of one shard's aggregates
+        for (int attempts = 0;; attempts++) {
+            unsigned sequence = read_begin(&shards[i].lock, attempts);
+            copy = shards[i].exam_stats[exam_index];
+            if (!read_retry(&shards[i].lock, sequence, attempts)) {
+                break;
+            }
+        }
+        total.count += copy.count;
+        total.sum += copy.sum;
+        total.passed += copy.passed;
+        for (int i = 1; i <= MAX_GRADE + 1; i++) {
+            total.tree[i] += copy.tree[i];  // Fenwick trees add up node by node
+        }
+    }
+    if (total.count == 0) {
+        report_error("Grade not found\n");
+        return;
+    }
+    int min = fenwick_find(total.tree, 1);
+    int max = fenwick_find(total.tree, total.count);
+    fprintf(output, "Exam: %d, Grades: %d, Average: %.2f, Min: %d, Max: %d, Pass rate: %.2f%%\n", exam_id,
+            total.count, (double)total.sum / total.count, min, max, 100.0 * total.passed / total.count);
+}
 
-        if (strcmp(cmd, "ADD_STUDENT") == 0) {
-            // Extract parameters for the ADD_STUDENT command
-            if (sscanf(command, "%*s %d %s %s", &id1, name, faculty) == 3) {
-                add_student(id1, name, faculty);
-            } else {
-                fprintf(output, "Invalid ADD_STUDENT command format\n");
+// Function to find the grade of a student in an exam and count the exam's grades up to it,
+// returns 0 if the student or the grade does not exist after printing why
+int rank_grade(int exam_id, int student_id, int *grade_value, int *at_or_below, int *count) {
+    Shard *shard = shard_of(student_id);
+    int student_index, exam_index;
+    for (int attempts = 0;; attempts++) {
+        unsigned sequence = read_begin(&shard->lock, attempts);
+        exam_index = -1;
+        student_index = find_student(shard, student_id);
+        int grade_index = student_index == -1 ? -1 : find_grade(shard, student_index, exam_id);
+        if (grade_index != -1) {
+            exam_index = shard->grades[grade_index].exam_index;
+            *grade_value = shard->grades[grade_index].grade;
+        }
+        if (exam_index != -1) {  // Counted in the same read, so the student's own grade is included
+            *count = shard->exam_stats[exam_index].count;
+            *at_or_below = fenwick_count(shard->exam_stats[exam_index].tree, *grade_value);
+        }
+        if (!read_retry(&shard->lock, sequence, attempts)) {
+            break;
+        }
+    }
+    if (student_index == -1) {
+        report_error("Student not found\n");
+        return 0;
+    }
+    if (exam_index == -1) {
+        report_error("Grade not found\n");
+        return 0;
+    }
+    for (int i = 0; i < shard_count; i++) {
+        if (&shards[i] == shard) {
+            continue;
+        }
+        int other_count, other_at_or_below;
+        for (int attempts = 0;; attempts++) {
+            unsigned sequence = read_begin(&shards[i].lock, attempts);
+            other_count = shards[i].exam_stats[exam_index].count;
+            other_at_or_below = fenwick_count(shards[i].exam_stats[exam_index].tree, *grade_value);
+            if (!read_retry(&shards[i].lock, sequence, attempts)) {
+                break;
             }
-        } else if (strcmp(cmd, "ADD_EXAM") == 0) {
-            if (sscanf(command, "%*s %d %s %s", &id1, type, info) == 3) {
-                add_exam(id1, type, info);
+        }
+        *count += other_count;
+        *at_or_below += other_at_or_below;
+    }
+    return 1;
+}
+
+// Function to display the rank of a student in an exam, equal grades share a rank
+void rank(int exam_id, int student_id) {
+    int grade_value, at_or_below, count;
+    if (rank_grade(exam_id, student_id, &grade_value, &at_or_below, &count)) {
+        fprintf(output, "Exam: %d, Student: %d, Grade: %d, Rank: %d of %d\n", exam_id, student_id, grade_value,
+                count - at_or_below + 1, count);
+    }
+}
+
+// Function to display the share of an exam's grades at or below the grade of a student
+void percentile(int exam_id, int student_id) {
+    int grade_value, at_or_below, count;
+    if (rank_grade(exam_id, student_id, &grade_value, &at_or_below, &count)) {
+        fprintf(output, "Exam: %d, Student: %d, Grade: %d, Percentile: %.2f\n", exam_id, student_id, grade_value,
+                100.0 * at_or_below / count);
+    }
+}
+
+// Function to start merging the shards' leaderboard lists of one grade value, the caller holds every shard lock
+void bucket_begin(int *next, int list, int key, int value) {
+    for (int i = 0; i < shard_count; i++) {
+        next[i] = shards[i].leaderboards[list][key * (MAX_GRADE + 1) + value];
+    }
+}
+
+// Function to get the next grade of merged shard lists by student and exam ID, NULL after the last one
+const Grade *bucket_next(int *next, int list, Shard **owner) {
+    Shard *first = NULL;  // Shard holding the grade of the lowest student and exam ID
+    for (int i = 0; i < shard_count; i++) {
+        if (next[i] == -1) {
+            continue;
+        }
+        const Grade *grade = &shards[i].grades[next[i]];
+        const Grade *best = first ? &first->grades[next[first - shards]] : NULL;
+        if (!best || grade->student_id < best->student_id ||
+            (grade->student_id == best->student_id && grade->exam_id < best->exam_id)) {
+            first = &shards[i];
+        }
+    }
+    if (!first) {
+        return NULL;  // No grade of this value is left
+    }
+    const Grade *grade = &first->grades[next[first - shards]];
+    next[first - shards] = grade->links[list].next;
+    *owner = first;
+    return grade;
+}
+
+// Function to display the best k grades of a leaderboard, merging the shards' lists by student
+// and exam ID, the caller holds every shard lock. Returns the number of grades listed
+int list_top_grades(int list, int key, int k) {
+    int listed = 0;
+    for (int value = MAX_GRADE; value >= 0 && listed < k; value--) {
+        int next[MAX_SHARDS];  // Next grade of every shard's list for this value
+        bucket_begin(next, list, key, value);
+        int rank = listed + 1;  // Equal grades share a rank
+        const Grade *grade;
+        Shard *owner;
+        while (listed < k && (grade = bucket_next(next, list, &owner))) {
+            const Student *student = &owner->students[find_student(owner, grade->student_id)];
+            fprintf(output, "Rank: %d, Student: %d, Name: %s, Exam: %d, Grade: %d\n", rank, grade->student_id,
+                    student->name, grade->exam_id, grade->grade);
+            listed++;
+        }
+    }
+    return listed;
+}
+
+// Function to display the k best grades of an exam, the caller holds every shard lock
+void top_k(int exam_id, int k) {
+    int exam_index = lookup_exam(exam_id);
+    if (exam_index == -1) {
+        report_error("Exam not found\n");
+        return;  // Ensure exam exists
+    }
+    if (list_top_grades(LIST_EXAM, exam_index, k) == 0) {
+        report_error("Grade not found\n");
+    }
+}
+
+// Function to display the k best grades of the students of a faculty, the caller holds every shard lock
+void top_k_faculty(const char *faculty, int k) {
+    int faculty_index = find_faculty(faculty);
+    if (faculty_index == -1) {
+        report_error("Invalid faculty\n");
+        return;  // Check for valid faculty name
+    }
+    if (list_top_grades(LIST_FACULTY, faculty_index, k) == 0) {
+        report_error("Grade not found\n");
+    }
+}
+
+// Function to display the grades of an exam within [low, high], lowest first, the caller holds every shard lock.
+// Only the buckets of the range are visited, so the time follows the size of the answer
+void grade_range(int exam_id, int low, int high) {
+    int exam_index = lookup_exam(exam_id);
+    if (exam_index == -1) {
+        report_error("Exam not found\n");
+        return;  // Ensure exam exists
+    }
+    if (low < 0 || high > MAX_GRADE || low > high) {
+        report_error("Invalid grade range\n");
+        return;  // The range must lie within 0..MAX_GRADE
+    }
+    int listed = 0;
+    for (int value = low; value <= high; value++) {
+        int next[MAX_SHARDS];  // Next grade of every shard's list for this value
+        bucket_begin(next, LIST_EXAM, exam_index, value);
+        const Grade *grade;
+        Shard *owner;
+        while ((grade = bucket_next(next, LIST_EXAM, &owner))) {
+            const Student *student = &owner->students[find_student(owner, grade->student_id)];
+            fprintf(output, "Student: %d, Name: %s, Grade: %d\n", grade->student_id, student->name, grade->grade);
+            listed++;
+        }
+    }
+    if (listed == 0) {
+        report_error("Grade not found\n");
+    }
+}
+
+// Function to display a student and all of their grades by exam ID, the caller holds the
+// student's shard lock and the exam lock
+void transcript(int student_id) {
+    Shard *shard = shard_of(student_id);
+    int index = find_student(shard, student_id);
+    if (index == -1) {
+        report_error("Student not found\n");
+        return;  // Ensure student exists
+    }
+    const Student *student = &shard->students[index];
+    fprintf(output, "ID: %d, Name: %s, Faculty: %s\n", student->id, student->name, student->faculty);
+    for (int next = student->first_grade; next != -1; next = shard->grades[next].links[LIST_TRANSCRIPT].next) {
+        const Grade *grade = &shard->grades[next];
+        const Exam *exam = &exams[grade->exam_index];
+        fprintf(output, "Exam: %d, Grade: %d, Type: %s, Info: %s\n", grade->exam_id, grade->grade, exam->type,
+                exam->info);
+    }
+}
+
+// Function to display the graded students of an exam by student ID, the caller holds every shard lock
+void roster(int exam_id) {
+    int exam_index = lookup_exam(exam_id);
+    if (exam_index == -1) {
+        report_error("Exam not found\n");
+        return;  // Ensure exam exists
+    }
+    int next[MAX_SHARDS];  // Next grade of every shard's roster
+    for (int i = 0; i < shard_count; i++) {
+        next[i] = shards[i].rosters[exam_index];
+    }
+    int listed = 0;
+    const Grade *grade;
+    Shard *owner;
+    while ((grade = bucket_next(next, LIST_ROSTER, &owner))) {
+        const Student *student = &owner->students[find_student(owner, grade->student_id)];
+        fprintf(output, "Student: %d, Name: %s, Grade: %d\n", grade->student_id, student->name, grade->grade);
+        listed++;
+    }
+    if (listed == 0) {
+        report_error("Grade not found\n");
+    }
+}
+
+// Structure of one set of a QUERY command and how it joins the sets before it
+typedef struct {
+    int operation;  // SET_AND, SET_OR or SET_ANDNOT
+    int faculty;  // Faculty index for FACULTY:name, -1 for PASSED:exam_id
+    int exam_index;  // Exam of PASSED:exam_id
+} QueryTerm;
+
+// Function to display the students of a set expression such as
+// FACULTY:DataScience AND PASSED:3 ANDNOT PASSED:9, evaluated left to right. The caller holds every shard lock
+void query(const char *expression) {
+    QueryTerm terms[MAX_QUERY_TERMS];
+    int term_count = 0;
+    int operation = SET_OR;  // The first set joins the empty set
+    int expect_set = 1;  // Sets and operators alternate
+    int invalid = 0;  // Unknown word or too many sets
+    char words[MAX_COMMAND_LENGTH];
+    strcpy(words, expression);
+    char *save;
+    for (char *word = strtok_r(words, " \t\r\n", &save); word; word = strtok_r(NULL, " \t\r\n", &save)) {
+        if (!expect_set) {
+            if (strcmp(word, "AND") == 0) {
+                operation = SET_AND;
+            } else if (strcmp(word, "OR") == 0) {
+                operation = SET_OR;
+            } else if (strcmp(word, "ANDNOT") == 0) {
+                operation = SET_ANDNOT;
             } else {
-                fprintf(output, "Invalid ADD_EXAM command format\n");
+                invalid = 1;
+                break;
             }
-        } else if (strcmp(cmd, "ADD_GRADE") == 0) {
-            if (sscanf(command, "%*s %d %d %d", &id1, &id2, &grade) == 3) {
-                add_grade(id1, id2, grade);
-            } else {
-                fprintf(output, "Invalid ADD_GRADE command format\n");
+            expect_set = 1;
+            continue;
+        }
+        QueryTerm *term = &terms[term_count];
+        int exam_id;
+        char rest;
+        if (term_count == MAX_QUERY_TERMS) {
+            invalid = 1;
+            break;
+        } else if (strncmp(word, "FACULTY:", 8) == 0) {
+            term->faculty = find_faculty(word + 8);
+            if (term->faculty == -1) {
+                report_error("Invalid faculty\n");
+                return;  // Check for valid faculty name
             }
-        } else if (strcmp(cmd, "UPDATE_EXAM") == 0) {
-            if (sscanf(command, "%*s %d %s %s", &id1, type, info) == 3) {
-                update_exam(id1, type, info);
-            } else {
-                fprintf(output, "Invalid UPDATE_EXAM command format\n");
+        } else if (strncmp(word, "PASSED:", 7) == 0 && sscanf(word + 7, "%d%c", &exam_id, &rest) == 1) {
+            term->faculty = -1;
+            term->exam_index = lookup_exam(exam_id);
+            if (term->exam_index == -1) {
+                report_error("Exam not found\n");
+                return;  // Ensure exam exists
             }
-        } else if (strcmp(cmd, "UPDATE_GRADE") == 0) {
-            if (sscanf(command, "%*s %d %d %d", &id1, &id2, &grade) == 3) {
-                update_grade(id1, id2, grade);
-            } else {
-                fprintf(output, "Invalid UPDATE_GRADE command format\n");
+        } else {
+            invalid = 1;
+            break;
+        }
+        term->operation = operation;
+        term_count++;
+        expect_set = 0;
+    }
+    if (invalid || expect_set) {
+        report_error("Invalid QUERY command format\n");
+        return;  // Empty expression, dangling operator or unknown word
+    }
+
+    // Shards hold disjoint students, so the answer is the union of the per-shard answers
+    Bitmap result = {NULL, 0, 0};
+    for (int i = 0; i < shard_count; i++) {
+        Bitmap shard_result = {NULL, 0, 0};
+        for (int t = 0; t < term_count; t++) {
+            const Bitmap *set = terms[t].faculty != -1 ? &shards[i].faculty_members[terms[t].faculty]
+                                                       : &shards[i].passed[terms[t].exam_index];
+            Bitmap combined;
+            bitmap_combine(&shard_result, set, terms[t].operation, &combined);
+            bitmap_free(&shard_result);
+            shard_result = combined;
+        }
+        Bitmap combined;
+        bitmap_combine(&result, &shard_result, SET_OR, &combined);
+        bitmap_free(&shard_result);
+        bitmap_free(&result);
+        result = combined;
+    }
+    if (result.count == 0) {
+        report_error("Student not found\n");
+    }
+    for (int c = 0; c < result.count; c++) {
+        const Container *container = &result.containers[c];
+        uint64_t *words = container_words(container);
+        for (int w = 0; w < CONTAINER_WORDS; w++) {
+            for (uint64_t word = words[w]; word; word &= word - 1) {
+                int id = bitmap_id((uint32_t)container->key << 16 | (uint32_t)(w * 64 + __builtin_ctzll(word)));
+                Shard *shard = shard_of(id);
+                const Student *student = &shard->students[find_student(shard, id)];
+                fprintf(output, "ID: %d, Name: %s, Faculty: %s\n", student->id, student->name, student->faculty);
             }
-        } else if (strcmp(cmd, "DELETE_STUDENT") == 0) {
-            if (sscanf(command, "%*s %d", &id1) == 1) {
-                delete_student(id1);
-            } else {
-                fprintf(output, "Invalid DELETE_STUDENT command format\n");
+        }
+        free(words);
+    }
+    bitmap_free(&result);
+}
+
+// Structure of a growable byte buffer that export rows are formatted into
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} TextBuffer;
+
+// Function to make room for more bytes in a text buffer
+void buffer_reserve(TextBuffer *buffer, size_t extra) {
+    if (buffer->capacity - buffer->length < extra) {
+        buffer->capacity = buffer->capacity * 2 > buffer->length + extra ? buffer->capacity * 2
+                                                                          : buffer->length + extra;
+        buffer->data = checked_realloc(buffer->data, buffer->capacity);
+    }
+}
+
+// Function to append an integer to a text buffer without going through printf
+void buffer_append_int(TextBuffer *buffer, int value) {
+    char digits[12];
+    int length = 0;
+    unsigned magnitude = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    do {
+        digits[length++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    buffer_reserve(buffer, length + 1);
+    if (value < 0) {
+        buffer->data[buffer->length++] = '-';
+    }
+    while (length > 0) {
+        buffer->data[buffer->length++] = digits[--length];
+    }
+}
+
+// Function to append a text field, quoted for CSV when it holds a separator or a quote
+void buffer_append_field(TextBuffer *buffer, const char *text, char separator) {
+    size_t length = strlen(text);
+    if (separator != ',' || !strpbrk(text, ",\"\r\n")) {
+        buffer_reserve(buffer, length);
+        memcpy(buffer->data + buffer->length, text, length);
+        buffer->length += length;
+        return;  // TSV fields cannot hold tabs, commands split words on whitespace
+    }
+    buffer_reserve(buffer, 2 * length + 2);
+    buffer->data[buffer->length++] = '"';
+    for (const char *c = text; *c; c++) {
+        if (*c == '"') {
+            buffer->data[buffer->length++] = '"';  // Quotes are doubled inside a quoted field
+        }
+        buffer->data[buffer->length++] = *c;
+    }
+    buffer->data[buffer->length++] = '"';
+}
+
+// Structure of a gradebook export shared by the threads that join the shards
+typedef struct {
+    char separator;  // ',' for CSV or '\t' for TSV
+    atomic_int next_shard;  // Next shard no thread has claimed yet
+    TextBuffer rows[MAX_SHARDS];  // Rows of every shard in the order of its students
+    size_t *row_ends[MAX_SHARDS];  // End of the rows of every student of a shard in rows
+    int done[MAX_SHARDS];  // Set once the rows of a shard are complete
+    pthread_mutex_t mutex;  // Guards done
+    pthread_cond_t shard_done;  // Signalled when a shard is complete
+} Export;
+
+// Function to join the grades of the shards a thread claims with their students and exams.
+// Shards partition the join: a grade and its student always live in the same shard, each student
+// is joined with its transcript list, and exams are found by their index. Rows come in student
+// insertion order and then by exam ID, as parallel batches may fill the grade table in any order
+void *export_thread(void *argument) {
+    Export *export = argument;
+    int i;
+    while ((i = atomic_fetch_add(&export->next_shard, 1)) < shard_count) {
+        Shard *shard = &shards[i];
+        TextBuffer *rows = &export->rows[i];
+        export->row_ends[i] = checked_realloc(NULL, (shard->student_count + 1) * sizeof(size_t));
+        for (int s = 0; s < shard->student_count; s++) {
+            const Student *student = &shard->students[s];
+            for (int g = student->first_grade; g != -1; g = shard->grades[g].links[LIST_TRANSCRIPT].next) {
+                const Grade *grade = &shard->grades[g];
+                const Exam *exam = &exams[grade->exam_index];
+                buffer_reserve(rows, EXPORT_ROW_LENGTH);
+                buffer_append_int(rows, student->id);
+                rows->data[rows->length++] = export->separator;
+                buffer_append_field(rows, student->name, export->separator);
+                rows->data[rows->length++] = export->separator;
+                buffer_append_field(rows, student->faculty, export->separator);
+                rows->data[rows->length++] = export->separator;
+                buffer_append_int(rows, exam->id);
+                rows->data[rows->length++] = export->separator;
+                buffer_append_field(rows, exam->type, export->separator);
+                rows->data[rows->length++] = export->separator;
+                buffer_append_field(rows, exam->info, export->separator);
+                rows->data[rows->length++] = export->separator;
+                buffer_append_int(rows, grade->grade);
+                rows->data[rows->length++] = '\n';
             }
-        } else if (strcmp(cmd, "SEARCH_STUDENT") == 0) {
-            if (sscanf(command, "%*s %d", &id1) == 1) {
-                search_student(id1);
-            } else {
-                fprintf(output, "Invalid SEARCH_STUDENT command format\n");
+            export->row_ends[i][s] = rows->length;
+        }
+        pthread_mutex_lock(&export->mutex);
+        export->done[i] = 1;
+        pthread_cond_broadcast(&export->shard_done);
+        pthread_mutex_unlock(&export->mutex);
+    }
+    return NULL;
+}
+
+// Function to write every grade with its student and exam as CSV or TSV rows. The shards are
+// joined in parallel and their rows merged by student insertion order, so the output does not
+// depend on the number of shards. The caller holds every shard lock and the exam lock
+void export_gradebook(const char *format) {
+    char separator = strcmp(format, "CSV") == 0 ? ',' : strcmp(format, "TSV") == 0 ? '\t' : 0;
+    if (!separator) {
+        report_error("Invalid export format\n");
+        return;  // Only CSV and TSV are supported
+    }
+    Export *export = calloc(1, sizeof(Export));
+    if (!export) {
+        report_error("Out of memory\n");
+        return;
+    }
+    export->separator = separator;
+    pthread_mutex_init(&export->mutex, NULL);
+    pthread_cond_init(&export->shard_done, NULL);
+    pthread_t threads[MAX_SHARDS];
+    int started = 0;
+    while (started < command_threads && started < shard_count &&
+           pthread_create(&threads[started], NULL, export_thread, export) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        export_thread(export);  // No thread could start, join everything here
+    }
+    fprintf(output, "student_id%cname%cfaculty%cexam_id%ctype%cinfo%cgrade\n", separator, separator, separator,
+            separator, separator, separator);
+    // Write the rows of consecutive students of one shard at once, later shards keep joining meanwhile
+    StudentMerge merge;
+    merge_begin(&merge);
+    int run_shard = -1;
+    size_t run_start = 0, run_end = 0;
+    int ready[MAX_SHARDS] = {0};
+    while (next_listed_student(&merge)) {
+        int i = merge.shard;
+        int s = merge.next[i] - 1;  // Position of the student in its shard
+        if (!ready[i]) {
+            pthread_mutex_lock(&export->mutex);
+            while (!export->done[i]) {
+                pthread_cond_wait(&export->shard_done, &export->mutex);
             }
-        } else if (strcmp(cmd, "SEARCH_GRADE") == 0) {
-            if (sscanf(command, "%*s %d %d", &id1, &id2) == 2) {
-                search_grade(id1, id2);
-            } else {
-                fprintf(output, "Invalid SEARCH_GRADE command format\n");
+            pthread_mutex_unlock(&export->mutex);
+            ready[i] = 1;
+        }
+        if (i != run_shard) {
+            if (run_end > run_start) {
+                fwrite(export->rows[run_shard].data + run_start, 1, run_end - run_start, output);
             }
-        } else if (strcmp(cmd, "LIST_ALL_STUDENTS") == 0) {
-            list_all_students();
-        } else if (strcmp(cmd, "END") == 0) {
-            // End processing commands
-            break;
-        } else {
-            fprintf(output, "Unknown command: %s\n", cmd);
+            run_shard = i;
+            run_start = s > 0 ? export->row_ends[i][s - 1] : 0;
         }
+        run_end = export->row_ends[i][s];
+    }
+    if (run_end > run_start) {
+        fwrite(export->rows[run_shard].data + run_start, 1, run_end - run_start, output);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
     }
+    for (int i = 0; i < shard_count; i++) {
+        free(export->rows[i].data);
+        free(export->row_ends[i]);
+    }
+    pthread_mutex_destroy(&export->mutex);
+    pthread_cond_destroy(&export->shard_done);
+    free(export);
+}
 
-    fclose(input);  // Close input file
-    fclose(output);  // Close output file
-    return 0;
-}
\ No newline at end of file
+enum { PAIR_COUNT, PAIR_SUM_A, PAIR_SUM_B, PAIR_SQUARES_A, PAIR_SQUARES_B, PAIR_PRODUCTS, PAIR_SUMS };
+
+// Structure of the dense exam by student matrix EXAM_CORRELATION works on, one row per exam by exam ID
+typedef struct {
+    int exams;  // Number of rows
+    int students;  // Number of columns, the students with at least one grade
+    int16_t *grades;  // First grade of every student in every exam, 0 where there is none
+    int16_t *mask;  // 1 where the student has a grade in the exam, 0 otherwise
+    long long *sums;  // PAIR_SUMS sums per pair of exams a < b, at pair_offset(exams, a, b)
+    atomic_int next_row;  // Next exam row no thread has claimed yet
+} Correlation;
+
+// Function to get the position of the sums of exams a < b, the pairs are stored row by row as
+// the upper triangle of the exam by exam matrix
+size_t pair_offset(int exams, int a, int b) {
+    return ((size_t)a * (2 * exams - a - 1) / 2 + (b - a - 1)) * PAIR_SUMS;
+}
+
+// Function to accumulate the sums of every pair of exams over the students both have grades of.
+// Missing grades are masked out of every sum, so pairs only count students enrolled in both.
+// Students are processed in blocks that keep the rows of a block in cache, and the inner loop
+// uses 32-bit integer sums the compiler vectorizes
+void *correlation_thread(void *argument) {
+    Correlation *matrix = argument;
+    int a;
+    while ((a = atomic_fetch_add(&matrix->next_row, 1)) < matrix->exams - 1) {
+        const int16_t *grades_a = matrix->grades + (size_t)a * matrix->students;
+        const int16_t *mask_a = matrix->mask + (size_t)a * matrix->students;
+        for (int start = 0; start < matrix->students; start += CORRELATION_BLOCK) {
+            int end = start + CORRELATION_BLOCK < matrix->students ? start + CORRELATION_BLOCK : matrix->students;
+            for (int b = a + 1; b < matrix->exams; b++) {
+                const int16_t *grades_b = matrix->grades + (size_t)b * matrix->students;
+                const int16_t *mask_b = matrix->mask + (size_t)b * matrix->students;
+                int count = 0, sum_a = 0, sum_b = 0, squares_a = 0, squares_b = 0, products = 0;
+                for (int s = start; s < end; s++) {
+                    count += mask_a[s] * mask_b[s];
+                    sum_a += grades_a[s] * mask_b[s];
+                    sum_b += mask_a[s] * grades_b[s];
+                    squares_a += grades_a[s] * grades_a[s] * mask_b[s];
+                    squares_b += mask_a[s] * grades_b[s] * grades_b[s];
+                    products += grades_a[s] * grades_b[s];
+                }
+                long long *sums = &matrix->sums[pair_offset(matrix->exams, a, b)];
+                sums[PAIR_COUNT] += count;
+                sums[PAIR_SUM_A] += sum_a;
+                sums[PAIR_SUM_B] += sum_b;
+                sums[PAIR_SQUARES_A] += squares_a;
+                sums[PAIR_SQUARES_B] += squares_b;
+                sums[PAIR_PRODUCTS] += products;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Function to display the Pearson correlation of the grades of every pair of exams by exam ID,
+// over the students graded in both. The matrix is copied under the locks and computed without them
+void exam_correlation(void) {
+    Correlation matrix = {0};
+    lock_all_shards();
+    pthread_mutex_lock(&exam_lock.mutex);
+    matrix.exams = exam_count;
+    for (int i = 0; i < shard_count; i++) {
+        for (int s = 0; s < shards[i].student_count; s++) {
+            matrix.students += shards[i].students[s].first_grade != -1;
+        }
+    }
+    // Rows follow the exam IDs: parallel batches may add exams to the table in any order
+    int ids[MAX_EXAMS];  // Exam ID of every row, as the exam table may grow once the locks are released
+    int row_of[MAX_EXAMS];  // Row of every exam in the exam table
+    for (int e = 0; e < matrix.exams; e++) {
+        int row = e;
+        while (row > 0 && ids[row - 1] > exams[e].id) {
+            ids[row] = ids[row - 1];
+            row--;
+        }
+        ids[row] = exams[e].id;
+    }
+    for (int e = 0; e < matrix.exams; e++) {
+        for (int row = 0; row < matrix.exams; row++) {
+            if (ids[row] == exams[e].id) {
+                row_of[e] = row;
+            }
+        }
+    }
+    size_t cells = (size_t)matrix.exams * matrix.students;
+    matrix.grades = calloc(cells ? cells : 1, sizeof(int16_t));
+    matrix.mask = calloc(cells ? cells : 1, sizeof(int16_t));
+    int column = 0;
+    for (int i = 0; matrix.grades && matrix.mask && i < shard_count; i++) {
+        Shard *shard = &shards[i];
+        for (int s = 0; s < shard->student_count; s++) {
+            int previous_exam = -1;  // Only the first grade of an exam counts, as in SEARCH_GRADE
+            int next = shard->students[s].first_grade;
+            for (; next != -1; next = shard->grades[next].links[LIST_TRANSCRIPT].next) {
+                const Grade *grade = &shard->grades[next];
+                if (grade->exam_index != previous_exam) {
+                    size_t cell = (size_t)row_of[grade->exam_index] * matrix.students + column;
+                    matrix.grades[cell] = (int16_t)grade->grade;
+                    matrix.mask[cell] = 1;
+                    previous_exam = grade->exam_index;
+                }
+            }
+            column += shard->students[s].first_grade != -1;
+        }
+    }
+    pthread_mutex_unlock(&exam_lock.mutex);
+    unlock_all_shards();
+
+    size_t pairs = (size_t)matrix.exams * (matrix.exams - 1) / 2 * PAIR_SUMS;
+    matrix.sums = calloc(pairs ? pairs : 1, sizeof(long long));
+    if (!matrix.grades || !matrix.mask || !matrix.sums) {
+        report_error("Out of memory\n");
+    } else if (matrix.exams < 2) {
+        report_error("Exam not found\n");  // No pair of exams to correlate
+    } else {
+        pthread_t threads[MAX_SERVER_THREADS];
+        int started = 0;
+        while (started < command_threads && started < matrix.exams - 1 &&
+               pthread_create(&threads[started], NULL, correlation_thread, &matrix) == 0) {
+            started++;
+        }
+        correlation_thread(&matrix);  // Also works here, and finishes the rows if no thread started
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        for (int a = 0; a < matrix.exams; a++) {
+            for (int b = a + 1; b < matrix.exams; b++) {
+                const long long *sums = &matrix.sums[pair_offset(matrix.exams, a, b)];
+                long long n = sums[PAIR_COUNT];
+                long long covariance = n * sums[PAIR_PRODUCTS] - sums[PAIR_SUM_A] * sums[PAIR_SUM_B];
+                long long variance_a = n * sums[PAIR_SQUARES_A] - sums[PAIR_SUM_A] * sums[PAIR_SUM_A];
+                long long variance_b = n * sums[PAIR_SQUARES_B] - sums[PAIR_SUM_B] * sums[PAIR_SUM_B];
+                if (n < 2 || variance_a == 0 || variance_b == 0) {
+                    fprintf(output, "Exams: %d and %d, Students: %lld, Correlation: N/A\n", ids[a], ids[b], n);
+                    continue;  // Undefined without two students and some spread on both sides
+                }
+                fprintf(output, "Exams: %d and %d, Students: %lld, Correlation: %.4f\n", ids[a], ids[b], n,
+                        (double)covariance / sqrt((double)variance_a * (double)variance_b));
+            }
+        }
+    }
+    free(matrix.grades);
+    free(matrix.mask);
+    free(matrix.sums);
+}
+
+// Types of the commands of the text protocol, in the order of command_names
+typedef enum {
+    COMMAND_ADD_STUDENT,
+    COMMAND_ADD_EXAM,
+    COMMAND_ADD_GRADE,
+    COMMAND_UPDATE_EXAM,
+    COMMAND_UPDATE_GRADE,
+    COMMAND_DELETE_STUDENT,
+    COMMAND_SEARCH_STUDENT,
+    COMMAND_SEARCH_GRADE,
+    COMMAND_LIST_ALL_STUDENTS,
+    COMMAND_EXAM_STATS,
+    COMMAND_RANK,
+    COMMAND_PERCENTILE,
+    COMMAND_TOP_K,
+    COMMAND_TOP_K_FACULTY,
+    COMMAND_SET_EXAM_WEIGHT,
+    COMMAND_STUDENT_AVERAGE,
+    COMMAND_LIST_AVERAGES,
+    COMMAND_GRADE_RANGE,
+    COMMAND_QUERY,
+    COMMAND_CURVE_EXAM,
+    COMMAND_TRANSCRIPT,
+    COMMAND_ROSTER,
+    COMMAND_EXPORT_GRADEBOOK,
+    COMMAND_EXAM_CORRELATION,
+    COMMAND_STATS,
+    COMMAND_SLOWLOG,
+    COMMAND_MEMORY,
+    COMMAND_END,
+    COMMAND_UNKNOWN  // Any other word, also the number of known commands
+} CommandType;
+
+// Names of the commands as they appear in the input
+const char *command_names[COMMAND_UNKNOWN] = {
+    "ADD_STUDENT", "ADD_EXAM", "ADD_GRADE", "UPDATE_EXAM", "UPDATE_GRADE", "DELETE_STUDENT",
+    "SEARCH_STUDENT", "SEARCH_GRADE", "LIST_ALL_STUDENTS", "EXAM_STATS", "RANK", "PERCENTILE",
+    "TOP_K", "TOP_K_FACULTY", "SET_EXAM_WEIGHT", "STUDENT_AVERAGE", "LIST_AVERAGES", "GRADE_RANGE",
+    "QUERY", "CURVE_EXAM", "TRANSCRIPT", "ROSTER", "EXPORT_GRADEBOOK",
+    "EXAM_CORRELATION", "STATS", "SLOWLOG", "MEMORY", "END",
+};
+
+// Structure to store a parsed command
+typedef struct {
+    CommandType type;  // Command type
+    int valid;  // 0 if the arguments do not match the command format
+    int id1, id2, grade;  // Numeric arguments in the order they appear
+    char text1[MAX_COMMAND_LENGTH];  // Name or exam type, or the word of an unknown command
+    char text2[MAX_COMMAND_LENGTH];  // Faculty or exam information
+    double scale, shift;  // Curve of CURVE_EXAM
+    char line[MAX_COMMAND_LENGTH];  // Command line without its newline, for the slowlog
+} Command;
+
+// With --trace FILE every thread records the phases of its commands as spans: reading input,
+// parsing, executing (locking included) and writing responses out. Serial runs write responses
+// through stdio while executing, batch windows write theirs out after running, and the server
+// sends them to each client after its commands ran.
+// Each thread appends to its own buffer without any synchronization, and the buffers are written
+// as Chrome trace JSON once every thread is done, for chrome://tracing or Perfetto.
+
+enum { TRACE_READ, TRACE_PARSE, TRACE_EXECUTE, TRACE_OUTPUT };  // Phases of a command
+const char *trace_phase_names[] = {"read", "parse", "execute", "output"};
+
+// Structure to store one span of a trace
+typedef struct {
+    unsigned long long start;  // read_ticks() when the phase began
+    unsigned long long ticks;  // Duration of the phase
+    short phase;
+    short command;  // Command type, -1 if not known in this phase
+} TraceEvent;
+
+// Structure to store the trace of one thread, written only by that thread
+typedef struct TraceBuffer {
+    struct TraceBuffer *next;  // Next buffer in trace_buffers
+    int thread;  // Thread number in the trace
+    int count;  // Events recorded
+    long long dropped;  // Events that did not fit
+    TraceEvent events[TRACE_EVENTS_PER_THREAD];  // Untouched pages cost no memory
+} TraceBuffer;
+
+int trace_enabled = 0;  // Set by --trace before any command runs
+TraceBuffer *trace_buffers = NULL;  // Buffers of every thread that traced
+int trace_thread_count = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards trace_buffers
+_Thread_local TraceBuffer *trace_buffer = NULL;  // Buffer of this thread, NULL until its first span
+
+// Function to start a span, returns 0 while tracing is off
+unsigned long long trace_begin(void) {
+    return trace_enabled ? read_ticks() : 0;
+}
+
+// Function to finish a span started by trace_begin
+void trace_end(int phase, int command, unsigned long long start) {
+    if (!start) {
+        return;
+    }
+    unsigned long long end = read_ticks();
+    if (!trace_buffer) {
+        trace_buffer = malloc(sizeof(TraceBuffer));
+        if (!trace_buffer) {
+            return;  // Tracing is best effort
+        }
+        trace_buffer->count = 0;
+        trace_buffer->dropped = 0;
+        pthread_mutex_lock(&trace_lock);
+        trace_buffer->thread = ++trace_thread_count;
+        trace_buffer->next = trace_buffers;
+        trace_buffers = trace_buffer;
+        pthread_mutex_unlock(&trace_lock);
+    }
+    if (trace_buffer->count == TRACE_EVENTS_PER_THREAD) {
+        trace_buffer->dropped++;
+        return;
+    }
+    TraceEvent *event = &trace_buffer->events[trace_buffer->count++];
+    event->start = start;
+    event->ticks = end - start;
+    event->phase = (short)phase;
+    event->command = (short)command;
+}
+
+// Function to write the spans of every thread as Chrome trace JSON, once no thread records anymore
+int trace_write(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("Failed to open trace file");
+        return -1;
+    }
+    double ticks_per_microsecond = ticks_per_nanosecond() * 1000;
+    long long dropped = 0;
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    const char *separator = "";
+    for (TraceBuffer *buffer = trace_buffers; buffer; buffer = buffer->next) {
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                separator, buffer->thread, buffer->thread);
+        separator = ",\n";
+        for (int i = 0; i < buffer->count; i++) {
+            const TraceEvent *event = &buffer->events[i];
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"command\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                    trace_phase_names[event->phase], buffer->thread,
+                    (double)(event->start - clock_start_ticks) / ticks_per_microsecond,
+                    event->ticks / ticks_per_microsecond);
+            if (event->command >= 0) {
+                fprintf(file, ",\"args\":{\"command\":\"%s\"}",
+                        event->command < COMMAND_UNKNOWN ? command_names[event->command] : "UNKNOWN");
+            }
+            fputc('}', file);
+        }
+        dropped += buffer->dropped;
+    }
+    fprintf(file, "\n]}\n");
+    if (dropped > 0) {
+        fprintf(stderr, "Trace buffers were full, %lld events were dropped\n", dropped);
+    }
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+// Function to parse a command line
+void parse_command(const char *line, Command *command) {
+    unsigned long long trace_start = trace_begin();
+    size_t length = strcspn(line, "\n");
+    length = length < MAX_COMMAND_LENGTH ? length : MAX_COMMAND_LENGTH - 1;
+    memcpy(command->line, line, length);
+    command->line[length] = '\0';
+    char cmd[30] = "";  // Command name buffer
+    sscanf(line, "%29s", cmd);  // Extract the command
+
+    command->type = COMMAND_UNKNOWN;
+    for (int i = 0; i < COMMAND_UNKNOWN; i++) {
+        if (strcmp(cmd, command_names[i]) == 0) {
+            command->type = (CommandType)i;
+            break;
+        }
+    }
+    // Extract the parameters. Text fields may be up to 255 characters, longer than the tables
+    // store, so every handler must still check the lengths it copies
+    switch (command->type) {
+    case COMMAND_ADD_STUDENT:
+    case COMMAND_ADD_EXAM:
+    case COMMAND_UPDATE_EXAM:
+        command->valid = sscanf(line, "%*s %d %255s %255s", &command->id1, command->text1, command->text2) == 3;
+        break;
+    case COMMAND_ADD_GRADE:
+    case COMMAND_UPDATE_GRADE:
+        command->valid = sscanf(line, "%*s %d %d %d", &command->id1, &command->id2, &command->grade) == 3;
+        break;
+    case COMMAND_DELETE_STUDENT:
+    case COMMAND_SEARCH_STUDENT:
+    case COMMAND_EXAM_STATS:
+    case COMMAND_STUDENT_AVERAGE:
+    case COMMAND_TRANSCRIPT:
+    case COMMAND_ROSTER:
+        command->valid = sscanf(line, "%*s %d", &command->id1) == 1;
+        break;
+    case COMMAND_SEARCH_GRADE:
+    case COMMAND_SET_EXAM_WEIGHT:
+    case COMMAND_RANK:
+    case COMMAND_PERCENTILE:
+        command->valid = sscanf(line, "%*s %d %d", &command->id1, &command->id2) == 2;
+        break;
+    case COMMAND_CURVE_EXAM:
+        command->valid = sscanf(line, "%*s %d %lf %lf", &command->id1, &command->scale, &command->shift) == 3;
+        break;
+    case COMMAND_EXPORT_GRADEBOOK:
+        command->valid = sscanf(line, "%*s %255s", command->text1) == 1;
+        break;
+    case COMMAND_QUERY:
+        command->valid = sscanf(line, "%*s %255[^\n]", command->text1) == 1;
+        break;
+    case COMMAND_GRADE_RANGE:
+        command->valid = sscanf(line, "%*s %d %d %d", &command->id1, &command->id2, &command->grade) == 3;
+        break;
+    case COMMAND_TOP_K:
+        command->valid = sscanf(line, "%*s %d %d", &command->id1, &command->id2) == 2 && command->id2 > 0;
+        break;
+    case COMMAND_TOP_K_FACULTY:
+        command->valid = sscanf(line, "%*s %255s %d", command->text1, &command->id1) == 2 && command->id1 > 0;
+        break;
+    case COMMAND_UNKNOWN:
+        strcpy(command->text1, cmd);
+        command->valid = 1;
+        break;
+    default:
+        command->valid = 1;  // Commands without parameters
+        break;
+    }
+    trace_end(TRACE_PARSE, command->type, trace_start);
+}
+
+// Commands are timed with read_ticks() around their execution and counted into log-linear
+// histograms in the style of HdrHistogram: buckets are exact below 2 * LATENCY_SUB_BUCKETS ticks
+// and then split every power of two into LATENCY_SUB_BUCKETS, so any latency is kept within
+// about 3% at a fixed memory cost. Every thread records into its own histograms, and STATS
+// merges the histograms of all threads.
+
+// Structure to store the latencies of one command type, written only by the owning thread
+typedef struct {
+    atomic_llong count;  // Commands executed
+    atomic_llong errors;  // Commands that reported an error
+    atomic_llong ticks;  // Time spent in all of them
+    atomic_llong max_ticks;  // Slowest command
+    atomic_llong buckets[LATENCY_BUCKETS];  // Commands per latency bucket
+} LatencyHistogram;
+
+// Structure to store the histograms of one command type merged over all threads
+typedef struct {
+    long long count;
+    long long errors;
+    long long ticks;
+    long long max_ticks;
+    long long buckets[LATENCY_BUCKETS];
+} LatencySummary;
+
+// Structure to store the latency histograms of one thread
+typedef struct LatencyRecorder {
+    struct LatencyRecorder *next;  // Next recorder in latency_recorders
+    LatencyHistogram histograms[COMMAND_UNKNOWN + 1];  // Indexed by command type
+} LatencyRecorder;
+
+LatencyRecorder *latency_recorders = NULL;  // Recorders of every thread that ran a command
+pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards latency_recorders
+_Thread_local LatencyRecorder *latency_recorder = NULL;  // Recorder of this thread, NULL until its first command
+
+// Function to find the histogram bucket of a latency
+int latency_bucket(unsigned long long ticks) {
+    if (ticks < 2 * LATENCY_SUB_BUCKETS) {
+        return (int)ticks;
+    }
+    int shift = 63 - __builtin_clzll(ticks) - 5;  // Keep the six highest bits, the first is always set
+    if (shift > LATENCY_MAX_SHIFT) {
+        return LATENCY_BUCKETS - 1;
+    }
+    return (shift + 1) * LATENCY_SUB_BUCKETS + (int)((ticks >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// Function to get the highest latency that falls into a histogram bucket
+unsigned long long latency_bucket_high(int bucket) {
+    if (bucket < 2 * LATENCY_SUB_BUCKETS) {
+        return (unsigned long long)bucket;
+    }
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    return ((unsigned long long)(bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+// Function to add to a counter only this thread writes, cheaper than an atomic increment
+void counter_add(atomic_llong *counter, long long value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+// Function to record the latency of a command in the histograms of this thread
+void latency_record(CommandType type, unsigned long long ticks, int failed) {
+    if (!latency_recorder) {
+        latency_recorder = calloc(1, sizeof(LatencyRecorder));
+        if (!latency_recorder) {
+            return;  // Statistics are best effort
+        }
+        pthread_mutex_lock(&latency_lock);
+        latency_recorder->next = latency_recorders;
+        latency_recorders = latency_recorder;
+        pthread_mutex_unlock(&latency_lock);
+    }
+    LatencyHistogram *histogram = &latency_recorder->histograms[type];
+    counter_add(&histogram->count, 1);
+    counter_add(&histogram->errors, failed);
+    counter_add(&histogram->ticks, (long long)ticks);
+    if ((long long)ticks > atomic_load_explicit(&histogram->max_ticks, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max_ticks, (long long)ticks, memory_order_relaxed);
+    }
+    counter_add(&histogram->buckets[latency_bucket(ticks)], 1);
+}
+
+// Function to merge the histograms of one command type over all threads
+void latency_merge(int type, LatencySummary *summary) {
+    memset(summary, 0, sizeof(LatencySummary));
+    pthread_mutex_lock(&latency_lock);
+    for (LatencyRecorder *recorder = latency_recorders; recorder; recorder = recorder->next) {
+        LatencyHistogram *histogram = &recorder->histograms[type];
+        summary->count += atomic_load_explicit(&histogram->count, memory_order_relaxed);
+        summary->errors += atomic_load_explicit(&histogram->errors, memory_order_relaxed);
+        summary->ticks += atomic_load_explicit(&histogram->ticks, memory_order_relaxed);
+        long long slowest = atomic_load_explicit(&histogram->max_ticks, memory_order_relaxed);
+        summary->max_ticks = slowest > summary->max_ticks ? slowest : summary->max_ticks;
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            summary->buckets[bucket] += atomic_load_explicit(&histogram->buckets[bucket], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&latency_lock);
+}
+
+// Function to clear the histograms of every thread, while no command runs
+void latency_reset(void) {
+    pthread_mutex_lock(&latency_lock);
+    for (LatencyRecorder *recorder = latency_recorders; recorder; recorder = recorder->next) {
+        memset(recorder->histograms, 0, sizeof(recorder->histograms));
+    }
+    pthread_mutex_unlock(&latency_lock);
+}
+
+// Function to get the latency in ticks below which a share of the merged commands completed
+long long latency_percentile(const LatencySummary *summary, double share) {
+    long long rank = (long long)ceil(share * summary->count);
+    long long seen = 0;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (seen += summary->buckets[bucket]) < rank) {
+        bucket++;
+    }
+    long long high = (long long)latency_bucket_high(bucket);
+    return high < summary->max_ticks ? high : summary->max_ticks;  // The slowest command bounds the last bucket
+}
+
+// Function to print the count, errors and latency percentiles of every command type that ran
+void print_stats(void) {
+    double ticks_per_microsecond = ticks_per_nanosecond() * 1000;
+    LatencySummary summary;
+    for (int type = 0; type <= COMMAND_UNKNOWN; type++) {
+        latency_merge(type, &summary);
+        if (summary.count == 0) {
+            continue;
+        }
+        fprintf(output, "Command: %s, Count: %lld, Errors: %lld, p50: %.2f us, p99: %.2f us, p999: %.2f us, "
+                        "Max: %.2f us\n",
+                type < COMMAND_UNKNOWN ? command_names[type] : "UNKNOWN", summary.count, summary.errors,
+                latency_percentile(&summary, 0.5) / ticks_per_microsecond,
+                latency_percentile(&summary, 0.99) / ticks_per_microsecond,
+                latency_percentile(&summary, 0.999) / ticks_per_microsecond, summary.max_ticks / ticks_per_microsecond);
+    }
+}
+
+// With --perf-counters every thread opens a group of hardware counters with perf_event_open and
+// reads it around every command, so the counters can be added up per command type. The group is
+// read with one read() call, which costs about a microsecond, so this is a diagnostic mode.
+// Only user space is counted, which perf_event_paranoid 2 still allows.
+
+const char *perf_counter_names[PERF_COUNTERS] = {"Cycles", "Instructions", "Cache misses", "Branch misses"};
+const unsigned long long perf_counter_configs[PERF_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+// Structure to store the counter totals of one thread, written only by that thread
+typedef struct PerfRecorder {
+    struct PerfRecorder *next;  // Next recorder in perf_recorders
+    int fds[PERF_COUNTERS];  // Counters of the group, the leader first, -1 if they could not be opened
+    atomic_llong commands[COMMAND_UNKNOWN + 1];  // Commands counted per command type
+    atomic_llong totals[COMMAND_UNKNOWN + 1][PERF_COUNTERS];  // Counter totals per command type
+} PerfRecorder;
+
+int perf_counters_enabled = 0;  // Set by --perf-counters before any command runs
+PerfRecorder *perf_recorders = NULL;  // Recorders of every thread that ran a command
+pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards perf_recorders
+_Thread_local PerfRecorder *perf_recorder = NULL;  // Recorder of this thread, NULL until its first command
+atomic_int perf_warned = 0;  // Set once a failure to open the counters was reported
+
+// Function to close the counters of a group that are open
+void perf_close_group(int *fds) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);  // Every counter of a group is its own file descriptor
+            fds[i] = -1;
+        }
+    }
+}
+
+// Function to open the counter group of this thread, returns -1 if the kernel refuses it
+int perf_open_group(int *fds) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        fds[i] = -1;
+    }
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = perf_counter_configs[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, fds[0], PERF_FLAG_FD_CLOEXEC);
+        if (fds[i] < 0) {
+            if (!atomic_exchange(&perf_warned, 1)) {
+                fprintf(stderr, "Hardware counters are not available: %s\n", strerror(errno));
+            }
+            perf_close_group(fds);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to close the counters of every thread once no more commands run
+void perf_close_all(void) {
+    pthread_mutex_lock(&perf_lock);
+    for (PerfRecorder *recorder = perf_recorders; recorder; recorder = recorder->next) {
+        perf_close_group(recorder->fds);
+    }
+    pthread_mutex_unlock(&perf_lock);
+}
+
+// Function to read the counters of this thread, returns 0 if they are not available
+int perf_read(long long *values) {
+    if (!perf_recorder) {
+        perf_recorder = calloc(1, sizeof(PerfRecorder));
+        if (!perf_recorder) {
+            return 0;  // Counters are best effort
+        }
+        perf_open_group(perf_recorder->fds);
+        pthread_mutex_lock(&perf_lock);
+        perf_recorder->next = perf_recorders;
+        perf_recorders = perf_recorder;
+        pthread_mutex_unlock(&perf_lock);
+    }
+    unsigned long long group[1 + PERF_COUNTERS];  // Number of counters, then their values
+    if (perf_recorder->fds[0] < 0 || read(perf_recorder->fds[0], group, sizeof(group)) != (ssize_t)sizeof(group)) {
+        return 0;
+    }
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        values[i] = (long long)group[1 + i];
+    }
+    return 1;
+}
+
+// Function to add the counters since before to the totals of a command type
+void perf_record(CommandType type, const long long *before) {
+    long long after[PERF_COUNTERS];
+    if (!perf_read(after)) {
+        return;
+    }
+    counter_add(&perf_recorder->commands[type], 1);
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        counter_add(&perf_recorder->totals[type][i], after[i] - before[i]);
+    }
+}
+
+// Function to print the average counters per command of every command type that was counted
+void print_perf_counters(FILE *file) {
+    pthread_mutex_lock(&perf_lock);
+    for (int type = 0; type <= COMMAND_UNKNOWN; type++) {
+        long long commands = 0;
+        long long totals[PERF_COUNTERS] = {0};
+        for (PerfRecorder *recorder = perf_recorders; recorder; recorder = recorder->next) {
+            commands += atomic_load_explicit(&recorder->commands[type], memory_order_relaxed);
+            for (int i = 0; i < PERF_COUNTERS; i++) {
+                totals[i] += atomic_load_explicit(&recorder->totals[type][i], memory_order_relaxed);
+            }
+        }
+        if (commands == 0) {
+            continue;
+        }
+        fprintf(file, "Command: %s, Count: %lld", type < COMMAND_UNKNOWN ? command_names[type] : "UNKNOWN", commands);
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+            fprintf(file, ", %s: %.1f", perf_counter_names[i], (double)totals[i] / commands);
+        }
+        fprintf(file, ", IPC: %.2f\n", totals[0] > 0 ? (double)totals[1] / totals[0] : 0.0);
+    }
+    pthread_mutex_unlock(&perf_lock);
+}
+
+// Commands slower than the slowlog threshold are kept in a ring buffer with their text, their
+// duration and the table sizes they ran against. Slow commands are rare, so the ring is guarded
+// by a plain mutex. SLOWLOG prints it, newest first, and it is written to stderr at exit.
+
+// Structure to store one slow command
+typedef struct {
+    long long id;  // Number of the slow command since the start
+    struct timespec time;  // Wall clock time when it finished
+    double microseconds;  // Duration
+    int students, exams, grades;  // Table sizes when it finished
+    char line[MAX_COMMAND_LENGTH];  // Command line
+} SlowlogEntry;
+
+long long slowlog_threshold = DEFAULT_SLOWLOG_THRESHOLD;  // In microseconds, negative disables the slowlog
+SlowlogEntry slowlog[SLOWLOG_ENTRIES];  // Ring of the latest slow commands
+long long slowlog_count = 0;  // Slow commands logged since the start, the newest is at slowlog_count - 1
+pthread_mutex_t slowlog_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards the ring
+
+// Function to log a command if it ran longer than the slowlog threshold
+void slowlog_record(const Command *command, unsigned long long ticks) {
+    if (slowlog_threshold < 0 || ticks < (unsigned long long)slowlog_threshold * 1000) {
+        return;  // Ticks are at least as fine as nanoseconds, so this skips every fast command cheaply
+    }
+    double microseconds = ticks / ticks_per_nanosecond() / 1000;
+    if (microseconds < slowlog_threshold) {
+        return;
+    }
+    pthread_mutex_lock(&slowlog_lock);
+    SlowlogEntry *entry = &slowlog[slowlog_count % SLOWLOG_ENTRIES];
+    entry->id = slowlog_count++;
+    clock_gettime(CLOCK_REALTIME, &entry->time);
+    entry->microseconds = microseconds;
+    entry->students = student_count;
+    entry->exams = exam_count;
+    entry->grades = grade_count;
+    strcpy(entry->line, command->line);
+    pthread_mutex_unlock(&slowlog_lock);
+}
+
+// Function to print the slow commands that are still in the ring, newest first
+void print_slowlog(FILE *file) {
+    pthread_mutex_lock(&slowlog_lock);
+    long long oldest = slowlog_count > SLOWLOG_ENTRIES ? slowlog_count - SLOWLOG_ENTRIES : 0;
+    for (long long i = slowlog_count - 1; i >= oldest; i--) {
+        const SlowlogEntry *entry = &slowlog[i % SLOWLOG_ENTRIES];
+        fprintf(file, "Slowlog: %lld, Time: %lld.%06ld, Duration: %.2f us, Students: %d, Exams: %d, Grades: %d, "
+                      "Command: %s\n",
+                entry->id, (long long)entry->time.tv_sec, entry->time.tv_nsec / 1000, entry->microseconds,
+                entry->students, entry->exams, entry->grades, entry->line);
+    }
+    pthread_mutex_unlock(&slowlog_lock);
+}
+
+// With --record FILE every command line is appended to FILE as it arrives, after the nanoseconds
+// since the start, so MoodleReplay can run the same traffic again with its original timing. The
+// lines of concurrent clients are written under a mutex in the order they arrived, without their
+// request tags.
+
+FILE *record_file = NULL;  // Set by --record before any command runs
+pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards record_file
+
+// Function to append a command line to the recording
+void record_command(const char *line) {
+    if (!record_file) {
+        return;
+    }
+    int length = (int)strcspn(line, "\n");
+    pthread_mutex_lock(&record_lock);
+    fprintf(record_file, "%lld %.*s\n", monotonic_nanoseconds() - clock_start_nanoseconds, length, line);
+    pthread_mutex_unlock(&record_lock);
+}
+
+// MEMORY accounts for the bytes of every table and index in four ways: used bytes hold live
+// entries, reserved bytes are allocated, resident bytes are backed by memory, and wasted bytes
+// are resident but hold nothing live. The tables are allocated at their maximum size and only
+// the pages they touch become resident, so their waste is what deleted students and grades
+// left behind. The indexes are filled when allocated, so their empty slots are waste from the
+// start. Small allocations are counted by malloc_usable_size(), so allocator slack is waste too.
+
+// Structure to store the memory of one table or index
+typedef struct {
+    const char *name;
+    size_t used;
+    size_t reserved;
+    size_t resident;
+} MemoryUsage;
+
+// Function to count the bytes of an allocation that are backed by memory
+size_t resident_bytes(const void *address, size_t length) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)address & ~(page - 1);
+    uintptr_t end = ((uintptr_t)address + length + page - 1) & ~(page - 1);
+    unsigned char *pages = malloc((end - start) / page);
+    if (!pages || mincore((void *)start, end - start, pages) != 0) {
+        free(pages);
+        return length;  // Assume all of it, so nothing is hidden
+    }
+    size_t resident = 0;
+    for (size_t i = 0; i < (end - start) / page; i++) {
+        resident += (pages[i] & 1) ? page : 0;
+    }
+    free(pages);
+    return resident < length ? resident : length;
+}
+
+// Function to add an allocation holding used live bytes to a memory usage
+void memory_add(MemoryUsage *usage, const void *allocation, size_t used) {
+    if (!allocation) {
+        return;
+    }
+    size_t reserved = malloc_usable_size((void *)allocation);
+    usage->used += used;
+    usage->reserved += reserved;
+    usage->resident += reserved >= MEMORY_MINCORE_BYTES ? resident_bytes(allocation, reserved) : reserved;
+}
+
+// Function to add the containers of a bitmap to a memory usage
+void memory_add_bitmap(MemoryUsage *usage, const Bitmap *bitmap) {
+    memory_add(usage, bitmap->containers, bitmap->count * sizeof(Container));
+    for (int i = 0; i < bitmap->count; i++) {
+        const Container *container = &bitmap->containers[i];
+        if (container->words) {
+            memory_add(usage, container->words, CONTAINER_WORDS * sizeof(uint64_t));
+        } else {
+            memory_add(usage, container->array, container->cardinality * sizeof(uint16_t));
+        }
+    }
+}
+
+// Function to print the memory of every table and index, or only their total.
+// The caller holds every shard lock and the exam lock
+void print_memory(FILE *file, int total_only) {
+    enum { MEMORY_STUDENTS, MEMORY_EXAMS, MEMORY_GRADES, MEMORY_GRADE_LISTS, MEMORY_EXAM_STATS,
+           MEMORY_STUDENT_INDEX, MEMORY_LEADERBOARDS, MEMORY_ROSTERS, MEMORY_PASSED, MEMORY_FACULTY_MEMBERS,
+           MEMORY_LATENCY_HISTOGRAMS, MEMORY_ROWS };
+    MemoryUsage rows[MEMORY_ROWS] = {
+        {"students", 0, 0, 0},        {"exams", 0, 0, 0},        {"grades", 0, 0, 0},
+        {"grade lists", 0, 0, 0},     {"exam stats", 0, 0, 0},   {"student index", 0, 0, 0},
+        {"leaderboards", 0, 0, 0},    {"rosters", 0, 0, 0},      {"passed bitmaps", 0, 0, 0},
+        {"faculty bitmaps", 0, 0, 0}, {"latency histograms", 0, 0, 0},
+    };
+    rows[MEMORY_EXAMS].used = exam_count * sizeof(Exam);  // A static array, not from malloc
+    rows[MEMORY_EXAMS].reserved = sizeof(exams);
+    rows[MEMORY_EXAMS].resident = resident_bytes(exams, sizeof(exams));
+    for (int i = 0; i < shard_count; i++) {
+        Shard *shard = &shards[i];
+        memory_add(&rows[MEMORY_STUDENTS], shard->students, shard->student_count * sizeof(Student));
+        memory_add(&rows[MEMORY_GRADES], shard->grades, shard->grade_count * sizeof(Grade));
+        memory_add(&rows[MEMORY_EXAM_STATS], shard->exam_stats, exam_count * sizeof(ExamStats));
+        memory_add(&rows[MEMORY_STUDENT_INDEX], shard->student_slots, shard->student_count * sizeof(int));
+        for (int list = 0; list < VALUE_LIST_COUNT; list++) {
+            size_t slots = list == LIST_EXAM ? (size_t)exam_count * (MAX_GRADE + 1) : list_slot_count(list);
+            memory_add(&rows[MEMORY_LEADERBOARDS], shard->leaderboards[list], slots * sizeof(int));
+            memory_add(&rows[MEMORY_LEADERBOARDS], shard->list_roots[list], slots * sizeof(int));
+        }
+        memory_add(&rows[MEMORY_ROSTERS], shard->rosters, exam_count * sizeof(int));
+        memory_add(&rows[MEMORY_ROSTERS], shard->list_roots[LIST_ROSTER], exam_count * sizeof(int));
+        memory_add(&rows[MEMORY_PASSED], shard->passed, exam_count * sizeof(Bitmap));
+        for (int exam = 0; exam < exam_count; exam++) {
+            memory_add_bitmap(&rows[MEMORY_PASSED], &shard->passed[exam]);
+        }
+        for (int faculty = 0; faculty < FACULTY_COUNT; faculty++) {
+            memory_add_bitmap(&rows[MEMORY_FACULTY_MEMBERS], &shard->faculty_members[faculty]);
+        }
+    }
+    // The list links live inside the grades, split the grade table by their share of a grade
+    MemoryUsage *grades = &rows[MEMORY_GRADES], *lists = &rows[MEMORY_GRADE_LISTS];
+    double link_share = (double)sizeof(((Grade *)NULL)->links) / sizeof(Grade);
+    lists->used = (size_t)(grades->used * link_share);
+    lists->reserved = (size_t)(grades->reserved * link_share);
+    lists->resident = (size_t)(grades->resident * link_share);
+    grades->used -= lists->used;
+    grades->reserved -= lists->reserved;
+    grades->resident -= lists->resident;
+    pthread_mutex_lock(&latency_lock);
+    for (LatencyRecorder *recorder = latency_recorders; recorder; recorder = recorder->next) {
+        memory_add(&rows[MEMORY_LATENCY_HISTOGRAMS], recorder, 0);
+    }
+    pthread_mutex_unlock(&latency_lock);
+    rows[MEMORY_LATENCY_HISTOGRAMS].used = rows[MEMORY_LATENCY_HISTOGRAMS].resident;  // Untouched buckets are zero
+
+    MemoryUsage total = {"total", 0, 0, 0};
+    size_t total_wasted = 0;
+    for (int i = 0; i < MEMORY_ROWS; i++) {
+        MemoryUsage *row = &rows[i];
+        size_t wasted = row->resident > row->used ? row->resident - row->used : 0;
+        if (!total_only) {
+            fprintf(file, "Memory: %s, Used: %zu, Reserved: %zu, Resident: %zu, Wasted: %zu\n", row->name, row->used,
+                    row->reserved, row->resident, wasted);
+        }
+        total.used += row->used;
+        total.reserved += row->reserved;
+        total.resident += row->resident;
+        total_wasted += wasted;
+    }
+    fprintf(file, "Memory: %s, Used: %zu, Reserved: %zu, Resident: %zu, Wasted: %zu\n", total.name, total.used,
+            total.reserved, total.resident, total_wasted);
+}
+
+// Function to run a parsed command, returns 1 on END
+int dispatch_command(const Command *command) {
+    if (!command->valid) {
+        report_error("Invalid %s command format\n", command_names[command->type]);
+        return 0;
+    }
+    switch (command->type) {
+    case COMMAND_ADD_STUDENT:
+        write_begin(&shard_of(command->id1)->lock);
+        add_student(command->id1, command->text1, command->text2);
+        write_end(&shard_of(command->id1)->lock);
+        break;
+    case COMMAND_ADD_EXAM:
+        write_begin(&exam_lock);
+        add_exam(command->id1, command->text1, command->text2);
+        write_end(&exam_lock);
+        break;
+    case COMMAND_ADD_GRADE:
+        write_begin(&shard_of(command->id2)->lock);
+        add_grade(command->id1, command->id2, command->grade);
+        write_end(&shard_of(command->id2)->lock);
+        break;
+    case COMMAND_UPDATE_EXAM:
+        write_begin(&exam_lock);
+        update_exam(command->id1, command->text1, command->text2);
+        write_end(&exam_lock);
+        break;
+    case COMMAND_UPDATE_GRADE:
+        write_begin(&shard_of(command->id2)->lock);
+        update_grade(command->id1, command->id2, command->grade);
+        write_end(&shard_of(command->id2)->lock);
+        break;
+    case COMMAND_DELETE_STUDENT:
+        write_begin(&shard_of(command->id1)->lock);
+        delete_student(command->id1);
+        write_end(&shard_of(command->id1)->lock);
+        break;
+    case COMMAND_SEARCH_STUDENT:
+        search_student(command->id1);
+        break;
+    case COMMAND_SEARCH_GRADE:
+        search_grade(command->id1, command->id2);
+        break;
+    case COMMAND_LIST_ALL_STUDENTS:
+        lock_all_shards();  // Too large to copy, hold writers off instead
+        list_all_students();
+        unlock_all_shards();
+        break;
+    case COMMAND_EXAM_STATS:
+        exam_stats(command->id1);
+        break;
+    case COMMAND_RANK:
+        rank(command->id1, command->id2);
+        break;
+    case COMMAND_PERCENTILE:
+        percentile(command->id1, command->id2);
+        break;
+    case COMMAND_TOP_K:
+        lock_all_shards();  // The lists of every shard are merged, hold writers off
+        top_k(command->id1, command->id2);
+        unlock_all_shards();
+        break;
+    case COMMAND_TOP_K_FACULTY:
+        lock_all_shards();
+        top_k_faculty(command->text1, command->id1);
+        unlock_all_shards();
+        break;
+    case COMMAND_SET_EXAM_WEIGHT:
+        write_begin_all_shards();  // Every shard may hold averages over this exam
+        write_begin(&exam_lock);
+        set_exam_weight(command->id1, command->id2);
+        write_end(&exam_lock);
+        write_end_all_shards();
+        break;
+    case COMMAND_STUDENT_AVERAGE:
+        student_average(command->id1);
+        break;
+    case COMMAND_GRADE_RANGE:
+        lock_all_shards();  // The lists of every shard are merged, hold writers off
+        grade_range(command->id1, command->id2, command->grade);
+        unlock_all_shards();
+        break;
+    case COMMAND_TRANSCRIPT:
+        pthread_mutex_lock(&shard_of(command->id1)->lock.mutex);  // Shard before exam, as everywhere
+        pthread_mutex_lock(&exam_lock.mutex);
+        transcript(command->id1);
+        pthread_mutex_unlock(&exam_lock.mutex);
+        pthread_mutex_unlock(&shard_of(command->id1)->lock.mutex);
+        break;
+    case COMMAND_ROSTER:
+        lock_all_shards();  // The rosters of every shard are merged, hold writers off
+        roster(command->id1);
+        unlock_all_shards();
+        break;
+    case COMMAND_EXPORT_GRADEBOOK:
+        lock_all_shards();  // One consistent snapshot of the whole gradebook
+        pthread_mutex_lock(&exam_lock.mutex);
+        export_gradebook(command->text1);
+        pthread_mutex_unlock(&exam_lock.mutex);
+        unlock_all_shards();
+        break;
+    case COMMAND_EXAM_CORRELATION:
+        exam_correlation();  // Copies the grades under the locks, computes without them
+        break;
+    case COMMAND_CURVE_EXAM:
+        write_begin_all_shards();  // Readers of any shard must not see the exam half curved
+        curve_exam(command->id1, command->scale, command->shift);
+        write_end_all_shards();
+        break;
+    case COMMAND_QUERY:
+        lock_all_shards();  // The bitmaps of every shard are combined, hold writers off
+        query(command->text1);
+        unlock_all_shards();
+        break;
+    case COMMAND_LIST_AVERAGES:
+        lock_all_shards();  // Too large to copy, hold writers off instead
+        list_averages();
+        unlock_all_shards();
+        break;
+    case COMMAND_SLOWLOG:
+        print_slowlog(output);
+        break;
+    case COMMAND_MEMORY:
+        lock_all_shards();  // Counts must match the tables they describe
+        pthread_mutex_lock(&exam_lock.mutex);
+        print_memory(output, 0);
+        pthread_mutex_unlock(&exam_lock.mutex);
+        unlock_all_shards();
+        break;
+    case COMMAND_STATS:
+        print_stats();
+        if (perf_counters_enabled) {
+            print_perf_counters(output);  // Averages per command, after the latencies
+        }
+        break;
+    case COMMAND_END:
+        return 1;  // End processing commands
+    case COMMAND_UNKNOWN:
+        report_error("Unknown command: %s\n", command->text1);
+        break;
+    }
+    return 0;
+}
+
+// Function to execute a parsed command and record its latency, returns 1 on END
+int execute_command(const Command *command) {
+    command_failed = 0;
+    long long counters[PERF_COUNTERS];
+    int counting = perf_counters_enabled && perf_read(counters);
+    MOODLE_PROBE2(command_entry, command->type, command->line);
+    unsigned long long start = read_ticks();
+    int ended = dispatch_command(command);
+    unsigned long long ticks = read_ticks() - start;
+    MOODLE_PROBE3(command_return, command->type, command_failed, ticks);
+    latency_record(command->type, ticks, command_failed);
+    slowlog_record(command, ticks);
+    if (counting) {
+        perf_record(command->type, counters);
+    }
+    trace_end(TRACE_EXECUTE, command->type, trace_enabled ? start : 0);
+    return ended;
+}
+
+// Function to parse and execute a single command line, returns 1 on END
+int process_command(const char *line) {
+    Command command;
+    parse_command(line, &command);
+    return execute_command(&command);
+}
+
+// The parallel batch executor reads input.txt in windows of commands. Every command names the
+// keys it reads or writes (a student, an exam, or the roster of all students). A command waits
+// for the earlier commands of its window that write a key it uses, or read a key it writes.
+// Independent commands run on a pool of work-stealing threads, each writing its responses into
+// its own buffer, and the responses are written out in input order afterwards.
+
+enum { KEY_STUDENT, KEY_EXAM, KEY_ROSTER };  // Kinds of keys in the dependency graph
+
+// Structure of one command in the dependency graph of a batch window
+typedef struct {
+    Command command;  // Parsed command
+    long long order;  // Insertion order, reserved in input order
+    atomic_int waiting;  // Earlier conflicting commands that have not finished yet
+    int first_successor;  // Commands waiting for this one, list in batch_edges
+    int worker;  // Worker whose buffer holds the response
+    long response_start;  // Response range in that buffer
+    long response_end;
+} BatchNode;
+
+// Structure of a list entry naming a command
+typedef struct {
+    int node;  // Index of the command in the window
+    int next;  // Next entry of the list, -1 at the end
+} BatchEdge;
+
+// Structure of one key in the hash table of a window
+typedef struct {
+    long long key;  // Kind and ID of the key, -1 for an empty slot
+    int last_writer;  // Last command writing the key, -1 if none
+    int first_reader;  // Commands reading the key since the last writer, list in batch_readers
+} BatchKey;
+
+// Structure of one thread of the pool and its work-stealing deque
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;  // Guards the deque, almost never contended
+    int *items;  // Runnable commands, the owner works at the bottom and thieves steal at the top
+    int top;
+    int bottom;
+    char *responses;  // Responses written by this thread during the window
+    size_t responses_length;
+} BatchWorker;
+
+static BatchNode *batch_nodes;  // Commands of the current window
+static int batch_size;  // Number of commands in the current window
+static BatchEdge *batch_edges;  // Dependency edges of the window
+static int batch_edge_count;
+static BatchEdge *batch_readers;  // Reader lists of the keys
+static int batch_reader_count;
+static BatchKey batch_keys[BATCH_KEY_SLOTS];  // Open-addressing hash table of the keys in the window
+static int *batch_used_keys;  // Slots to clear before the next window
+static int batch_used_key_count;
+static int batch_student_adds, batch_exam_adds, batch_grade_adds;  // Capacity needed by the window
+static BatchWorker batch_workers[MAX_SERVER_THREADS];
+static int batch_worker_count;
+static atomic_int batch_remaining;  // Commands of the window not finished yet
+static atomic_int batch_exiting;  // Tells the pool threads to return
+static pthread_barrier_t batch_start, batch_done;  // Window boundaries for the pool
+
+// Function to add a dependency edge, the later command waits for the earlier one
+static void batch_edge(int from, int to) {
+    batch_edges[batch_edge_count].node = to;
+    batch_edges[batch_edge_count].next = batch_nodes[from].first_successor;
+    batch_nodes[from].first_successor = batch_edge_count++;
+    atomic_fetch_add_explicit(&batch_nodes[to].waiting, 1, memory_order_relaxed);
+}
+
+// Function to record that a command reads or writes a key
+static void batch_access(int node, int kind, int id, int write) {
+    long long key = ((long long)kind << 32) | (unsigned)id;
+    unsigned slot = (unsigned)((key * 0x9E3779B97F4A7C15ull) >> 40) & (BATCH_KEY_SLOTS - 1);
+    while (batch_keys[slot].key != -1 && batch_keys[slot].key != key) {
+        slot = (slot + 1) & (BATCH_KEY_SLOTS - 1);
+    }
+    BatchKey *entry = &batch_keys[slot];
+    if (entry->key == -1) {
+        entry->key = key;
+        entry->last_writer = -1;
+        entry->first_reader = -1;
+        batch_used_keys[batch_used_key_count++] = (int)slot;
+    }
+    if (entry->last_writer >= 0) {
+        batch_edge(entry->last_writer, node);
+    }
+    if (write) {
+        for (int reader = entry->first_reader; reader >= 0; reader = batch_readers[reader].next) {
+            batch_edge(batch_readers[reader].node, node);
+        }
+        entry->first_reader = -1;
+        entry->last_writer = node;
+    } else {
+        batch_readers[batch_reader_count].node = node;
+        batch_readers[batch_reader_count].next = entry->first_reader;
+        entry->first_reader = batch_reader_count++;
+    }
+}
+
+// Function to add a parsed command to the graph, returns 0 for a command that must run alone
+static int batch_analyse(int index) {
+    BatchNode *node = &batch_nodes[index];
+    const Command *command = &node->command;
+    node->order = -1;
+    node->first_successor = -1;
+    atomic_store_explicit(&node->waiting, 0, memory_order_relaxed);
+    if (!command->valid) {
+        return 1;  // Only prints an error, conflicts with nothing
+    }
+    switch (command->type) {
+    case COMMAND_ADD_STUDENT:
+        node->order = atomic_fetch_add(&student_order, 1);
+        batch_student_adds++;
+        batch_access(index, KEY_STUDENT, command->id1, 1);
+        batch_access(index, KEY_ROSTER, 0, 0);  // Adds and deletes commute, listing does not
+        break;
+    case COMMAND_DELETE_STUDENT:
+        batch_access(index, KEY_STUDENT, command->id1, 1);
+        batch_access(index, KEY_ROSTER, 0, 0);
+        break;
+    case COMMAND_ADD_EXAM:
+        batch_exam_adds++;
+        batch_access(index, KEY_EXAM, command->id1, 1);
+        break;
+    case COMMAND_UPDATE_EXAM:
+        batch_access(index, KEY_EXAM, command->id1, 1);
+        break;
+    case COMMAND_ADD_GRADE:
+        batch_grade_adds++;
+        batch_access(index, KEY_STUDENT, command->id2, 1);
+        batch_access(index, KEY_EXAM, command->id1, 0);
+        break;
+    case COMMAND_UPDATE_GRADE:
+        batch_access(index, KEY_STUDENT, command->id2, 1);
+        break;
+    case COMMAND_SEARCH_STUDENT:
+    case COMMAND_STUDENT_AVERAGE:
+        batch_access(index, KEY_STUDENT, command->id1, 0);
+        break;
+    case COMMAND_SEARCH_GRADE:
+        batch_access(index, KEY_STUDENT, command->id2, 0);
+        batch_access(index, KEY_EXAM, command->id1, 0);
+        break;
+    case COMMAND_LIST_ALL_STUDENTS:
+        batch_access(index, KEY_ROSTER, 0, 1);
+        break;
+    case COMMAND_UNKNOWN:
+        break;  // Only prints an error
+    default:
+        return 0;  // Commands without a key model run on their own between windows
+    }
+    return 1;
+}
+
+// Function to push a runnable command on the deque of a worker
+static void batch_push(BatchWorker *worker, int node) {
+    pthread_mutex_lock(&worker->lock);
+    worker->items[worker->bottom++] = node;
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// Function to take a runnable command, from the bottom of our own deque or the top of another one
+static int batch_take(BatchWorker *worker, int steal) {
+    int node = -1;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->bottom > worker->top) {
+        node = steal ? worker->items[worker->top++] : worker->items[--worker->bottom];
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return node;
+}
+
+// Function to execute commands of the current window until all of them have finished
+static void batch_work(int self) {
+    BatchWorker *worker = &batch_workers[self];
+    FILE *saved_output = output;
+    output = open_memstream(&worker->responses, &worker->responses_length);
+    if (!output) {
+        perror("Failed to allocate responses");
+        exit(1);  // The window could never finish
+    }
+    while (atomic_load(&batch_remaining) > 0) {
+        int index = batch_take(worker, 0);
+        for (int i = 1; index < 0 && i < batch_worker_count; i++) {
+            index = batch_take(&batch_workers[(self + i) % batch_worker_count], 1);
+        }
+        if (index < 0) {
+            sched_yield();  // Everything runnable is taken, wait for dependencies to finish
+            continue;
+        }
+        BatchNode *node = &batch_nodes[index];
+        node->worker = self;
+        node->response_start = ftell(output);
+        reserved_order = node->order;
+        execute_command(&node->command);
+        reserved_order = -1;
+        node->response_end = ftell(output);
+        for (int edge = node->first_successor; edge >= 0; edge = batch_edges[edge].next) {
+            int successor = batch_edges[edge].node;
+            if (atomic_fetch_sub(&batch_nodes[successor].waiting, 1) == 1) {
+                batch_push(worker, successor);  // Last dependency done, run it here while it is hot
+            }
+        }
+        atomic_fetch_sub(&batch_remaining, 1);  // Only after the successors became visible
+    }
+    fclose(output);
+    output = saved_output;
+}
+
+// Function to run one pool thread across all windows
+static void *batch_thread(void *argument) {
+    int self = (int)(intptr_t)argument;
+    for (;;) {
+        pthread_barrier_wait(&batch_start);
+        if (atomic_load(&batch_exiting)) {
+            return NULL;
+        }
+        batch_work(self);
+        pthread_barrier_wait(&batch_done);
+    }
+}
+
+// Function to apply the current window and write its responses in input order
+static void batch_run_window(void) {
+    if (batch_size == 0) {
+        return;
+    }
+    if (student_count + batch_student_adds > MAX_STUDENTS || exam_count + batch_exam_adds > MAX_EXAMS ||
+        grade_count + batch_grade_adds > MAX_GRADES) {
+        // A table may fill up, so which add fails depends on the order: run the window serially
+        for (int i = 0; i < batch_size; i++) {
+            reserved_order = batch_nodes[i].order;
+            execute_command(&batch_nodes[i].command);
+        }
+        reserved_order = -1;
+        return;
+    }
+
+    for (int i = 0; i < batch_worker_count; i++) {
+        batch_workers[i].top = batch_workers[i].bottom = 0;
+    }
+    int next_worker = 0;
+    for (int i = 0; i < batch_size; i++) {
+        if (atomic_load_explicit(&batch_nodes[i].waiting, memory_order_relaxed) == 0) {
+            batch_push(&batch_workers[next_worker], i);  // Spread the initial work round-robin
+            next_worker = (next_worker + 1) % batch_worker_count;
+        }
+    }
+    atomic_store(&batch_remaining, batch_size);
+    pthread_barrier_wait(&batch_start);
+    batch_work(0);  // The calling thread is worker 0
+    pthread_barrier_wait(&batch_done);
+
+    unsigned long long trace_start = trace_begin();
+    for (int i = 0; i < batch_size; i++) {
+        BatchNode *node = &batch_nodes[i];
+        fwrite(batch_workers[node->worker].responses + node->response_start, 1,
+               (size_t)(node->response_end - node->response_start), output);
+    }
+    trace_end(TRACE_OUTPUT, -1, trace_start);
+    for (int i = 0; i < batch_worker_count; i++) {
+        free(batch_workers[i].responses);
+        batch_workers[i].responses = NULL;
+    }
+}
+
+// Function to start a new window
+static void batch_reset(void) {
+    for (int i = 0; i < batch_used_key_count; i++) {
+        batch_keys[batch_used_keys[i]].key = -1;
+    }
+    batch_used_key_count = 0;
+    batch_size = batch_edge_count = batch_reader_count = 0;
+    batch_student_adds = batch_exam_adds = batch_grade_adds = 0;
+}
+
+// Function to run the commands of input on a pool of threads with the output of a serial run
+int run_batch_parallel(FILE *input, int threads) {
+    batch_nodes = malloc(BATCH_WINDOW * sizeof(BatchNode));
+    batch_edges = malloc(BATCH_WINDOW * 2 * BATCH_MAX_KEYS * sizeof(BatchEdge));  // At most two per access
+    batch_readers = malloc(BATCH_WINDOW * BATCH_MAX_KEYS * sizeof(BatchEdge));
+    batch_used_keys = malloc(BATCH_WINDOW * BATCH_MAX_KEYS * sizeof(int));
+    if (!batch_nodes || !batch_edges || !batch_readers || !batch_used_keys) {
+        fprintf(stderr, "Failed to allocate the batch executor\n");
+        return 1;
+    }
+    for (int i = 0; i < BATCH_KEY_SLOTS; i++) {
+        batch_keys[i].key = -1;
+    }
+    batch_worker_count = threads;
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&batch_workers[i].lock, NULL);
+        batch_workers[i].items = malloc(BATCH_WINDOW * sizeof(int));
+        if (!batch_workers[i].items) {
+            fprintf(stderr, "Failed to allocate the batch executor\n");
+            return 1;
+        }
+    }
+    pthread_barrier_init(&batch_start, NULL, (unsigned)threads);
+    pthread_barrier_init(&batch_done, NULL, (unsigned)threads);
+    pthread_t pool[MAX_SERVER_THREADS];
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&pool[i], NULL, batch_thread, (void *)(intptr_t)i) != 0) {
+            perror("Failed to start batch thread");
+            exit(1);  // The barriers count on every thread
+        }
+    }
+
+    char line[MAX_COMMAND_LENGTH];  // Command buffer
+    int ended = 0;
+    while (!ended) {
+        batch_reset();
+        Command *alone = NULL;  // Command without a key model that ended the window
+        while (batch_size < BATCH_WINDOW) {
+            unsigned long long trace_start = trace_begin();
+            if (!fgets(line, sizeof(line), input)) {
+                ended = 1;
+                break;
+            }
+            trace_end(TRACE_READ, -1, trace_start);
+            record_command(line);
+            parse_command(line, &batch_nodes[batch_size].command);
+            if (batch_nodes[batch_size].command.type == COMMAND_END) {
+                ended = 1;  // Stop at the END command
+                break;
+            }
+            if (!batch_analyse(batch_size)) {
+                alone = &batch_nodes[batch_size].command;
+                break;
+            }
+            batch_size++;
+        }
+        batch_run_window();
+        if (alone) {
+            execute_command(alone);  // Runs between the windows, after and before everything else
+        }
+    }
+
+    atomic_store(&batch_exiting, 1);
+    pthread_barrier_wait(&batch_start);
+    for (int i = 1; i < threads; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    return 0;
+}
+
+// Structure to store the state of one server client
+typedef struct {
+    int fd;  // Client socket
+    char in[CONNECTION_BUFFER_SIZE];  // Bytes received but not yet executed
+    size_t in_len;  // Number of bytes in the input buffer
+    char *out;  // Responses not yet sent to the client
+    size_t out_len;  // Number of bytes in the output buffer
+    size_t out_sent;  // Number of output bytes already sent
+    size_t out_cap;  // Allocated size of the output buffer
+    int finished;  // Set once the client sent END or closed its side
+} Connection;
+
+// Structure shared by all server event loop threads
+typedef struct {
+    int epoll_fd;  // Epoll instance watching the listening socket and every client
+    int listen_fd;  // Listening socket
+    int events_per_wait;  // Events taken per epoll_wait, smaller with more threads for fairness
+} Server;
+
+static volatile sig_atomic_t server_stopping = 0;  // Set by SIGINT/SIGTERM
+static int stop_fd = -1;  // Eventfd that wakes every event loop thread on shutdown
+static char stop_marker;  // Its address marks the eventfd in epoll events
+
+// Function to request a graceful server shutdown from a signal handler
+static void stop_server(int signal_number) {
+    (void)signal_number;
+    int saved_errno = errno;  // The interrupted code may be about to read errno
+    server_stopping = 1;
+    unsigned long long one = 1;
+    ssize_t ignored = write(stop_fd, &one, sizeof(one));  // Level-triggered, so all threads wake up
+    (void)ignored;
+    errno = saved_errno;
+}
+
+// Function to append bytes to the pending output of a connection
+static int connection_append(Connection *conn, const char *data, size_t length) {
+    if (conn->out_len + length > conn->out_cap) {
+        size_t capacity = conn->out_cap ? conn->out_cap : 4096;
+        while (capacity < conn->out_len + length) {
+            capacity *= 2;
+        }
+        char *grown = realloc(conn->out, capacity);
+        if (!grown) {
+            return -1;  // Out of memory, caller drops the client
+        }
+        conn->out = grown;
+        conn->out_cap = capacity;
+    }
+    memcpy(conn->out + conn->out_len, data, length);
+    conn->out_len += length;
+    return 0;
+}
+
+// Structure of a parsed command handed to the worker that owns a shard
+struct ShardTask {
+    ShardTask *next;  // Next task in the shard queue
+    ShardTask *batch_next;  // Next task of the same client batch, in command order
+    Command command;  // Command to execute, parsed once by the connection thread
+    char tag[MAX_TAG_LENGTH];  // Request tag of a pipelined command, empty if untagged
+    long long order;  // Insertion order reserved when the command was queued
+    char *response;  // Output of the command, filled in by the worker
+    size_t response_length;
+    struct Completion *completion;  // Signalled once the response is ready
+};
+
+// Structure to wait for a group of shard tasks
+typedef struct Completion {
+    pthread_mutex_t mutex;
+    pthread_cond_t done;
+    int remaining;  // Tasks that have not finished yet
+} Completion;
+
+static atomic_int shard_workers_running = 0;  // Set while shard workers accept tasks
+
+// Function to find the shard whose worker applies a write command, NULL for commands run inline
+static Shard *command_owner(const Command *command) {
+    if (!command->valid) {
+        return NULL;
+    }
+    if (command->type == COMMAND_ADD_STUDENT || command->type == COMMAND_DELETE_STUDENT) {
+        return shard_of(command->id1);
+    }
+    if (command->type == COMMAND_ADD_GRADE || command->type == COMMAND_UPDATE_GRADE) {
+        return shard_of(command->id2);
+    }
+    return NULL;
+}
+
+// Function to run the queued writes of one shard, so its tables stay in one core's cache
+static void *shard_worker(void *argument) {
+    Shard *shard = argument;
+    for (;;) {
+        pthread_mutex_lock(&shard->queue_lock);
+        while (!shard->queue_head && atomic_load(&shard_workers_running)) {
+            pthread_cond_wait(&shard->queue_ready, &shard->queue_lock);
+        }
+        ShardTask *task = shard->queue_head;  // Take the whole queue at once
+        shard->queue_head = shard->queue_tail = NULL;
+        pthread_mutex_unlock(&shard->queue_lock);
+        if (!task) {
+            return NULL;  // Stopped and drained
+        }
+        while (task) {
+            ShardTask *next = task->next;  // The waiter may free the task once it completes
+            output = open_memstream(&task->response, &task->response_length);
+            if (output) {
+                reserved_order = task->order;  // Keep the client's command order across shards
+                execute_command(&task->command);
+                reserved_order = -1;
+                fclose(output);
+            }
+            Completion *completion = task->completion;
+            pthread_mutex_lock(&completion->mutex);
+            if (--completion->remaining == 0) {
+                pthread_cond_signal(&completion->done);
+            }
+            pthread_mutex_unlock(&completion->mutex);
+            task = next;
+        }
+    }
+}
+
+// Function to queue a command on the worker that owns its shard
+static void shard_submit(Shard *shard, ShardTask *task) {
+    pthread_mutex_lock(&task->completion->mutex);
+    task->completion->remaining++;
+    pthread_mutex_unlock(&task->completion->mutex);
+    task->next = NULL;
+    pthread_mutex_lock(&shard->queue_lock);
+    if (shard->queue_tail) {
+        shard->queue_tail->next = task;
+    } else {
+        shard->queue_head = task;
+    }
+    shard->queue_tail = task;
+    pthread_cond_signal(&shard->queue_ready);
+    pthread_mutex_unlock(&shard->queue_lock);
+}
+
+// Function to write the response of one command, framed as "@TAG BYTES\n" if it was tagged
+static void write_response(const char *tag, const char *response, size_t length) {
+    if (tag[0]) {
+        fprintf(output, "@%s %zu\n", tag, length);
+    }
+    fwrite(response, 1, length, output);
+}
+
+// Function to split the optional "@TAG " prefix of a pipelined command, returns the command itself
+static const char *split_tag(const char *line, char *tag) {
+    tag[0] = '\0';
+    if (line[0] != '@') {
+        return line;  // Untagged commands keep the plain protocol
+    }
+    size_t length = strcspn(line + 1, " \t\r\n");
+    if (length == 0 || length >= MAX_TAG_LENGTH || line[1 + length] != ' ') {
+        return line;  // Not a valid tag, reported as an unknown command
+    }
+    memcpy(tag, line + 1, length);
+    tag[length] = '\0';
+    return line + 2 + length;
+}
+
+// Function to wait for queued commands and write their responses in command order
+static void shard_wait(Completion *completion, ShardTask **batch) {
+    pthread_mutex_lock(&completion->mutex);
+    while (completion->remaining > 0) {
+        pthread_cond_wait(&completion->done, &completion->mutex);
+    }
+    pthread_mutex_unlock(&completion->mutex);
+    while (*batch) {
+        ShardTask *task = *batch;
+        *batch = task->batch_next;
+        if (task->response) {
+            write_response(task->tag, task->response, task->response_length);
+        } else {
+            write_response(task->tag, "Out of memory\n", strlen("Out of memory\n"));
+        }
+        free(task->response);
+        free(task);
+    }
+}
+
+// Function to start one worker per shard
+static void start_shard_workers(void) {
+    atomic_store(&shard_workers_running, 1);
+    for (int i = 0; i < shard_count; i++) {
+        if (pthread_create(&shards[i].worker, NULL, shard_worker, &shards[i]) != 0) {
+            perror("Failed to start shard worker");
+            exit(1);  // Commands for this shard would never complete
+        }
+    }
+}
+
+// Function to stop the shard workers after every client batch completed
+static void stop_shard_workers(void) {
+    atomic_store(&shard_workers_running, 0);
+    for (int i = 0; i < shard_count; i++) {
+        pthread_mutex_lock(&shards[i].queue_lock);
+        pthread_cond_signal(&shards[i].queue_ready);
+        pthread_mutex_unlock(&shards[i].queue_lock);
+        pthread_join(shards[i].worker, NULL);
+    }
+}
+
+// Function to execute every complete line in the input buffer of a connection
+static int connection_execute(Connection *conn, int at_eof) {
+    char *responses = NULL;  // All responses of this batch, sent with one write
+    size_t responses_length = 0;
+    output = open_memstream(&responses, &responses_length);
+    if (!output) {
+        return -1;
+    }
+
+    // Writes go to the worker owning their shard, everything else runs here once the
+    // writes before it have completed, so each client still sees its commands in order
+    Completion completion = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+    ShardTask *batch = NULL;  // Queued writes of this batch, oldest first
+    ShardTask **batch_tail = &batch;
+    size_t start = 0;
+    while (!conn->finished && start < conn->in_len) {
+        char *newline = memchr(conn->in + start, '\n', conn->in_len - start);
+        size_t length = newline ? (size_t)(newline - (conn->in + start)) + 1 : conn->in_len - start;
+        if (length > MAX_COMMAND_LENGTH - 1) {
+            length = MAX_COMMAND_LENGTH - 1;  // Split long lines exactly like fgets in batch mode
+        } else if (!newline && !at_eof) {
+            break;  // Wait for the rest of the line
+        }
+        char line[MAX_COMMAND_LENGTH];
+        memcpy(line, conn->in + start, length);
+        line[length] = '\0';
+        start += length;
+        char tag[MAX_TAG_LENGTH];  // Pipelining clients match responses to commands by tag
+        const char *command = split_tag(line, tag);
+        record_command(command);
+        Command parsed;
+        parse_command(command, &parsed);
+        Shard *owner = command_owner(&parsed);
+        ShardTask *task = owner ? malloc(sizeof(ShardTask)) : NULL;
+        if (task) {
+            task->command = parsed;
+            strcpy(task->tag, tag);
+            task->order = atomic_fetch_add(&student_order, 1);
+            task->response = NULL;
+            task->completion = &completion;
+            task->batch_next = NULL;
+            *batch_tail = task;
+            batch_tail = &task->batch_next;
+            shard_submit(owner, task);
+            continue;
+        }
+        shard_wait(&completion, &batch);
+        batch_tail = &batch;
+        if (!tag[0]) {
+            conn->finished = execute_command(&parsed);  // END closes this client's session
+            continue;
+        }
+        FILE *batch_output = output;
+        char *response = NULL;  // A tagged response needs its length before its frame header
+        size_t response_length = 0;
+        output = open_memstream(&response, &response_length);
+        if (!output) {
+            output = batch_output;
+            write_response(tag, "Out of memory\n", strlen("Out of memory\n"));
+            continue;
+        }
+        conn->finished = execute_command(&parsed);
+        fclose(output);
+        output = batch_output;
+        write_response(tag, response, response_length);
+        free(response);
+    }
+    shard_wait(&completion, &batch);
+    memmove(conn->in, conn->in + start, conn->in_len - start);
+    conn->in_len -= start;
+
+    fclose(output);
+    output = NULL;
+    int result = connection_append(conn, responses, responses_length);
+    free(responses);
+    return result;
+}
+
+// Function to send as much pending output as the socket accepts, returns -1 on error
+static int connection_flush(Connection *conn) {
+    while (conn->out_sent < conn->out_len) {
+        unsigned long long trace_start = trace_begin();
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        trace_end(TRACE_OUTPUT, -1, trace_start);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        conn->out_sent += (size_t)sent;
+    }
+    conn->out_len = conn->out_sent = 0;  // Everything went out, reuse the buffer
+    return 0;
+}
+
+// Function to close a client and release its buffers
+static void connection_close(int epoll_fd, Connection *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->out);
+    free(conn);
+}
+
+// Function to re-arm a connection, only one thread at a time ever handles a client
+static void connection_watch(int epoll_fd, Connection *conn) {
+    struct epoll_event event = {0};
+    event.events = EPOLLONESHOT;
+    event.data.ptr = conn;
+    if (!conn->finished && conn->out_len - conn->out_sent < MAX_PENDING_OUTPUT) {
+        event.events |= EPOLLIN;  // Apply backpressure to clients that do not read their responses
+    }
+    if (conn->out_sent < conn->out_len) {
+        event.events |= EPOLLOUT;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+// Function to handle readiness of a client socket, returns -1 when the client must be closed
+static int connection_handle(Connection *conn, unsigned int events) {
+    if (events & EPOLLIN) {
+        for (;;) {
+            if (conn->in_len == sizeof(conn->in)) {
+                if (connection_execute(conn, 0) < 0) {
+                    return -1;
+                }
+            }
+            unsigned long long trace_start = trace_begin();
+            ssize_t received = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, 0);
+            trace_end(TRACE_READ, -1, trace_start);
+            if (received > 0) {
+                conn->in_len += (size_t)received;
+                continue;
+            }
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;  // Drained the socket for now
+            }
+            if (received < 0) {
+                return -1;
+            }
+            if (connection_execute(conn, 1) < 0) {  // Run a trailing line without newline, like fgets
+                return -1;
+            }
+            conn->finished = 1;  // Client closed its side
+            break;
+        }
+        if (connection_execute(conn, 0) < 0) {
+            return -1;
+        }
+    } else if (events & (EPOLLHUP | EPOLLERR)) {
+        return -1;
+    }
+    if (connection_flush(conn) < 0) {
+        return -1;
+    }
+    if (conn->finished && conn->out_sent == conn->out_len) {
+        return -1;  // Session is over and all responses were delivered
+    }
+    return 0;
+}
+
+// Function to accept every pending client on the listening socket
+static void server_accept(int epoll_fd, int listen_fd) {
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Failed to accept client");
+            }
+            return;
+        }
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (!conn) {
+            close(fd);
+            continue;  // Refuse the client rather than crash the server
+        }
+        conn->fd = fd;
+        struct epoll_event event = {0};
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("Failed to register client");
+            close(fd);
+            free(conn);
+        }
+    }
+}
+
+// Function to raise the open file limit so that thousands of clients can connect
+static void raise_file_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Function to run one event loop thread of the server
+static void *server_loop(void *argument) {
+    Server *server = argument;
+    struct epoll_event events[MAX_EVENTS];
+    while (!server_stopping) {
+        int ready = epoll_wait(server->epoll_fd, events, server->events_per_wait, -1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            Connection *conn = events[i].data.ptr;
+            if (events[i].data.ptr == &stop_marker) {
+                server_stopping = 1;
+            } else if (!conn) {
+                server_accept(server->epoll_fd, server->listen_fd);
+            } else if (connection_handle(conn, events[i].events) < 0) {
+                connection_close(server->epoll_fd, conn);
+            } else {
+                connection_watch(server->epoll_fd, conn);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Function to serve the text command protocol over a Unix domain socket
+int serve(const char *socket_path, int threads) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path is too long\n");
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("Failed to create socket");
+        return 1;
+    }
+    unlink(socket_path);  // Remove a stale socket left by a previous run
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        perror("Failed to listen on socket");
+        close(listen_fd);
+        return 1;
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listen_event = {0};
+    listen_event.events = EPOLLIN;
+    listen_event.data.ptr = NULL;  // NULL marks the listening socket
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) < 0) {
+        perror("Failed to set up epoll");
+        close(listen_fd);
+        unlink(socket_path);
+        return 1;
+    }
+
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event stop_event = {0};
+    stop_event.events = EPOLLIN;
+    stop_event.data.ptr = &stop_marker;
+    if (stop_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &stop_event) < 0) {
+        perror("Failed to set up shutdown event");
+        close(epoll_fd);
+        close(listen_fd);
+        unlink(socket_path);
+        return 1;
+    }
+
+    raise_file_limit();
+    struct sigaction action = {0};
+    action.sa_handler = stop_server;  // No SA_RESTART, so epoll_wait returns on a signal
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    Server server;
+    server.epoll_fd = epoll_fd;
+    server.listen_fd = listen_fd;
+    server.events_per_wait = MAX_EVENTS / threads > 0 ? MAX_EVENTS / threads : 1;
+
+    start_shard_workers();
+    pthread_t workers[MAX_SERVER_THREADS];
+    int started = 1;  // The calling thread is the first event loop
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, server_loop, &server) != 0) {
+            perror("Failed to start server thread");
+            break;  // Serve with the threads we have
+        }
+    }
+    server_loop(&server);
+    for (int i = 1; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    stop_shard_workers();
+
+    close(epoll_fd);  // Open clients are dropped on shutdown
+    close(stop_fd);
+    close(listen_fd);
+    unlink(socket_path);
+    return 0;
+}
+
+#ifndef MOODLE_NO_MAIN  // Benchmarks include this file and provide their own main()
+int main(int argc, char **argv) {
+    const char *socket_path = NULL;  // Serve clients instead of running input.txt
+    const char *trace_path = NULL;  // Write a Chrome trace of the command phases here
+    const char *record_path = NULL;  // Record the command stream with its timing here
+    long threads = 0;  // Set by --threads, 0 runs a batch serially and serves with one thread per core
+    long shards_wanted = 0;  // Set by --shards, 0 gives one shard per thread
+    int usage_error = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            shards_wanted = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--slowlog-threshold") == 0 && i + 1 < argc) {
+            slowlog_threshold = strtoll(argv[++i], NULL, 10);  // Microseconds, 0 logs every command
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            perf_counters_enabled = 1;  // Printed per command type to stderr at exit, and by STATS
+        } else {
+            usage_error = 1;
+        }
+    }
+    if (threads == 0 && socket_path) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = threads < 1 ? 1 : threads > MAX_SHARDS ? MAX_SHARDS : threads;
+    } else if (threads == 0) {
+        threads = 1;  // The parallel executor only runs when asked for
+    }
+    if (shards_wanted == 0) {
+        shards_wanted = threads < MAX_SHARDS ? threads : MAX_SHARDS;
+    }
+    if (usage_error || threads < 1 || threads > MAX_SERVER_THREADS || shards_wanted < 1 || shards_wanted > MAX_SHARDS) {
+        fprintf(stderr, "Usage: %s [--threads N] [--shards N] [--trace FILE] [--record FILE] [--perf-counters]\n"
+                        "       [--slowlog-threshold MICROSECONDS] [--serve SOCKET_PATH]\n", argv[0]);
+        return 1;
+    }
+    command_threads = (int)threads;
+    if (init_shards((int)shards_wanted) < 0) {
+        fprintf(stderr, "Failed to allocate the tables\n");
+        return 1;
+    }
+    trace_enabled = trace_path != NULL;
+    if (record_path && !(record_file = fopen(record_path, "w"))) {
+        perror("Failed to open record file");
+        return 1;
+    }
+    if (socket_path) {
+        int result = serve(socket_path, (int)threads);  // Long-running daemon mode, state is kept in memory
+        if (record_file && fclose(record_file) != 0) {
+            perror("Failed to write record file");
+            result = 1;
+        }
+        if (trace_path && trace_write(trace_path) < 0) {
+            result = 1;
+        }
+        if (perf_counters_enabled) {
+            print_perf_counters(stderr);
+            perf_close_all();
+        }
+        print_slowlog(stderr);
+        print_memory(stderr, 1);  // Every thread is done, no locks needed
+        return result;
+    }
+
+    FILE *input = fopen("input.txt", "r");  // Open input file in reading mode
+    if (!input) {
+        perror("Failed to open input file");
+        return 1;  // Return 1 if input file cannot be opened
+    }
+
+    output = fopen("output.txt", "w");  // Open output file in writing mode
+    if (!output) {
+        perror("Failed to open output file");
+        fclose(input);
+        return 1;  // Return 1 if output file cannot be opened
+    }
+
+    if (threads > 1) {
+        if (run_batch_parallel(input, (int)threads) != 0) {
+            fclose(input);
+            fclose(output);
+            return 1;
+        }
+    } else {
+        char command[MAX_COMMAND_LENGTH];  // Command buffer
+        unsigned long long trace_start = trace_begin();
+        while (fgets(command, sizeof(command), input)) {
+            trace_end(TRACE_READ, -1, trace_start);
+            record_command(command);
+            if (process_command(command)) {
+                break;  // Stop at the END command
+            }
+            trace_start = trace_begin();
+        }
+    }
+
+    fclose(input);  // Close input file
+    fclose(output);  // Close output file
+    if (record_file && fclose(record_file) != 0) {
+        perror("Failed to write record file");
+        return 1;
+    }
+    if (perf_counters_enabled) {
+        print_perf_counters(stderr);
+        perf_close_all();
+    }
+    print_slowlog(stderr);
+    print_memory(stderr, 1);  // Every thread is done, no locks needed
+    if (trace_path && trace_write(trace_path) < 0) {
+        return 1;
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,156 @@
+// Replays a command stream recorded with --record against the engine and reports its latencies
+// Build: cc -O2 -pthread MoodleReplay.c -o MoodleReplay -lm
+// Usage: ./MoodleReplay RECORDING [--speed FACTOR] [--shards N] [--threads N] [--output FILE]
+//        --speed 1 keeps the recorded timing, 2 replays twice as fast, 0 as fast as possible
+// Tables are sized at build time and should match the recorded engine, e.g. -DMAX_STUDENTS=1000000
+#define MOODLE_NO_MAIN  // Reuse the engine without its batch main()
+#include "MoodleReplacement.c"
+
+#include <time.h>
+
+#define RECORD_LINE_LENGTH (MAX_COMMAND_LENGTH + 32)  // A recorded line is a timestamp and a command
+
+// Commands run one at a time in the recorded order. Each command is due at its recorded time
+// divided by the speed, and its response time runs from then until it finished. When the
+// engine cannot keep up, later commands start late and the wait shows in their response time,
+// while the service time measured by the engine covers only the command itself.
+
+static LatencySummary response_times[COMMAND_UNKNOWN + 1];  // From the due time to the finish, per command type
+static LatencySummary service_times[COMMAND_UNKNOWN + 1];  // Merged from the engine's histograms
+
+// Function to add a latency in ticks to a summary
+static void summary_add(LatencySummary *summary, long long ticks) {
+    summary->count++;
+    summary->ticks += ticks;
+    summary->max_ticks = ticks > summary->max_ticks ? ticks : summary->max_ticks;
+    summary->buckets[latency_bucket((unsigned long long)ticks)]++;
+}
+
+// Function to wait until a CLOCK_MONOTONIC time in nanoseconds
+static void sleep_until(long long nanoseconds) {
+    struct timespec time = {nanoseconds / 1000000000LL, nanoseconds % 1000000000LL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, NULL) == EINTR) {
+        // Interrupted by a signal, sleep on
+    }
+}
+
+// Function to print the latency distribution of every command type that ran
+static void print_latencies(const char *title, const LatencySummary *summaries) {
+    double ticks_per_ns = ticks_per_nanosecond();
+    printf("%s\n", title);
+    printf("%-16s %12s %10s %10s %10s %10s %10s %10s %10s\n", "command", "count", "errors", "mean us", "p50 us",
+           "p90 us", "p99 us", "p99.9 us", "max us");
+    for (int type = 0; type <= COMMAND_UNKNOWN; type++) {
+        const LatencySummary *summary = &summaries[type];
+        if (summary->count == 0) {
+            continue;
+        }
+        double ticks_per_us = ticks_per_ns * 1000;
+        printf("%-16s %12lld %10lld %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+               type < COMMAND_UNKNOWN ? command_names[type] : "UNKNOWN", summary->count, summary->errors,
+               summary->ticks / ticks_per_us / summary->count, latency_percentile(summary, 0.5) / ticks_per_us,
+               latency_percentile(summary, 0.9) / ticks_per_us, latency_percentile(summary, 0.99) / ticks_per_us,
+               latency_percentile(summary, 0.999) / ticks_per_us, summary->max_ticks / ticks_per_us);
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *recording_path = NULL;
+    const char *output_path = "/dev/null";  // Responses are formatted but thrown away by default
+    double speed = 1;
+    int shards = 1;
+    int threads = 1;
+    int usage_error = 0;
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-' && !recording_path) {
+            recording_path = argv[i];
+        } else if (i + 1 >= argc) {
+            usage_error = 1;
+        } else if (strcmp(argv[i], "--speed") == 0) {
+            speed = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--shards") == 0) {
+            shards = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0) {
+            output_path = argv[++i];
+        } else {
+            usage_error = 1;
+        }
+    }
+    if (usage_error || !recording_path || speed < 0 || shards < 1 || shards > MAX_SHARDS || threads < 1 ||
+        threads > MAX_SERVER_THREADS) {
+        fprintf(stderr, "Usage: %s RECORDING [--speed FACTOR] [--shards N] [--threads N] [--output FILE]\n"
+                        "       --speed 1 keeps the recorded timing, 0 replays as fast as possible\n", argv[0]);
+        return 1;
+    }
+    FILE *recording = fopen(recording_path, "r");
+    if (!recording) {
+        perror("Failed to open recording");
+        return 1;
+    }
+    output = fopen(output_path, "w");
+    if (!output) {
+        perror("Failed to open output file");
+        fclose(recording);
+        return 1;
+    }
+    command_threads = threads;  // Threads a single command may split its work over
+    if (init_shards(shards) < 0) {
+        fprintf(stderr, "Failed to allocate the tables\n");
+        return 1;
+    }
+    double ticks_per_ns = ticks_per_nanosecond();
+
+    char line[RECORD_LINE_LENGTH];
+    long long commands = 0, late = 0, first_time = -1, last_time = 0, max_lag = 0, skipped = 0;
+    long long start = monotonic_nanoseconds();
+    while (fgets(line, sizeof(line), recording)) {
+        char *command;
+        long long time = strtoll(line, &command, 10);
+        if (command == line || *command != ' ' || time < 0) {
+            skipped++;  // Not a recorded line
+            continue;
+        }
+        command++;
+        if (first_time < 0) {
+            first_time = time;
+        }
+        last_time = time;
+        long long due = speed > 0 ? start + (long long)((time - first_time) / speed) : monotonic_nanoseconds();
+        long long now = monotonic_nanoseconds();
+        if (now < due) {
+            sleep_until(due);
+        } else if (now - due > max_lag) {
+            max_lag = now - due;
+        }
+        late += speed > 0 && now > due + 1000000;  // More than a millisecond behind the recorded timing
+        Command parsed;
+        parse_command(command, &parsed);
+        execute_command(&parsed);  // END only closed a client's session, so the replay runs on
+        long long response = monotonic_nanoseconds() - due;
+        summary_add(&response_times[parsed.type], (long long)(response * ticks_per_ns));
+        response_times[parsed.type].errors += command_failed;
+        commands++;
+    }
+    double elapsed = (monotonic_nanoseconds() - start) / 1e9;
+    fclose(recording);
+    fclose(output);
+
+    printf("Replayed %lld commands recorded over %.3f s in %.3f s at speed %g (0 = as fast as possible), "
+           "%.0f commands/s\n",
+           commands, first_time < 0 ? 0 : (last_time - first_time) / 1e9, elapsed, speed,
+           elapsed > 0 ? commands / elapsed : 0);
+    if (skipped) {
+        printf("Skipped %lld lines that were not recorded commands\n", skipped);
+    }
+    if (speed > 0) {
+        printf("Started %lld commands more than 1 ms late, at most %.3f ms\n", late, max_lag / 1e6);
+    }
+    for (int type = 0; type <= COMMAND_UNKNOWN; type++) {
+        latency_merge(type, &service_times[type]);
+    }
+    print_latencies("Service time, measured by the engine around each command:", service_times);
+    print_latencies("Response time, from the recorded arrival to the finish:", response_times);
+    return 0;
+}